@@ -1,10 +1,22 @@
 /* Simple recreation of tetris using the curses library
  * Check LICENCE for copyright and licence details */
 
+#define _POSIX_C_SOURCE 200809L
+
+#include <ctype.h>
+#include <errno.h>
+#include <locale.h>
 #include <ncurses.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
 #include <time.h>
 #include <unistd.h>
 
@@ -12,16 +24,26 @@
 
 #define MINLINES 38
 #define MINCOLS 82
+#define COMPACT_MINLINES 20
+#define COMPACT_MINCOLS 50
+#define MIN_LINES (compact ? COMPACT_MINLINES : MINLINES)
+#define MIN_COLS (compact ? COMPACT_MINCOLS : MINCOLS)
 #define GAME_BLOCK_HEIGHT 18
 #define GAME_BLOCK_WIDTH 10
 #define BOX_CHAR ' '
 #define NO_BLOCK 0
 #define MAX_SPEED_LEVEL 20
-#define REF_GAME(G)     \
-    draw_game_box((G)); \
-    refresh();
+#define NONE 0
+/* Limits of the rule sets */
+#define MAX_PIECES 32
+#define MAX_LEVELS 64
+#define MAX_KICKS 8
 #define MAXX(W) (getmaxx((W)) - 2)
 #define MAXY(W) (getmaxy((W)) - 2)
+/* Size of the game box in terminal cells. Compact mode packs two block rows
+ * in one line using half-block characters and uses two columns per block */
+#define BOX_LINES (compact ? (GAME_BLOCK_HEIGHT + 1) / 2 : GAME_BLOCK_HEIGHT * 2)
+#define BOX_COLS (compact ? GAME_BLOCK_WIDTH * 2 : GAME_BLOCK_WIDTH * 4)
 
 /* Points gained by deleting X lines multiplied by the level */
 #define POINTS_1_LINES 40
@@ -33,38 +55,224 @@
 #define POINTS_POS 4
 #define NEXT_POS -10
 #define HOLD_POS -20
-#define GAME_OVER_COL 17
-#define GAME_OVER_ROW(N) (19 + (N))
-
-/* Game speed. Where L is the level */
-#define GSPEED(L) ((L)->level <= MAX_SPEED_LEVEL ? CLOCKS_PER_SEC / (L)->level : CLOCKS_PER_SEC / MAX_SPEED_LEVEL)
+#define STATS_COL (compact ? 2 : 5)
+#define GAME_OVER_COL (compact ? 2 : 17)
+#define GAME_OVER_ROW(N) ((compact ? 3 : 19) + (N))
+
+/* Game speed in microseconds. Where L is the level */
+#define GSPEED(L) (rules.gravity[((L)->level < rules.nlevels ? (L)->level : rules.nlevels) - 1])
+/* Built-in game speed at level L, until MAX_SPEED_LEVEL */
+#define DEFAULT_GSPEED(L) (1000000L / (L))
 /* Next color. Where C is previous color */
 #define NCOLOR(C) ((C) % 4 + 1)
+/* Color pair of a half block with foreground F and background B (0 is the terminal default) */
+#define HALF_PAIR(F, B) (20 + (F) * 6 + (B))
 
 /* Keys */
 #define KEY_ESCAPE 27
 
+/* Longest time between two frames when the terminal can't keep up (us) */
+#define MAX_FRAME_INTERVAL 250000
+/* Time over which the output rate is measured (us) */
+#define RATE_WINDOW 500000
+
+/* Placements that can be undone in practice mode. The ring buffer keeps one
+ * more checkpoint, for the tetromino being played */
+#define REWIND_CAP 64
+#define REWIND_SLOTS (REWIND_CAP + 1)
+
+/* Keys that can wait to be handled by the game thread */
+#define INPUT_CAP 64
+/* Marks a snapshot that hasn't been drawn yet */
+#define SNAP_FRESH 4
+/* How long the game and render loops sleep when there's nothing to do (ns) */
+#define IDLE_SLEEP 1000000
+
+/* Tetromino kind of the engine, the index of its piece in the rules */
+#define KIND(T) ((T).type - 1)
+/* Row of the engine's boards with all the blocks */
+#define FULL_ROW ((1 << GAME_BLOCK_WIDTH) - 1)
+/* Values per game of the batch observations: the rows, the tetromino
+ * (kind, rotation, column, row), the next kind, lines cleared and game over */
+#define OBS_SIZE (GAME_BLOCK_HEIGHT + 7)
+/* Perft limits. The table holds at most 1 << PERFT_MAX_TABLE_BITS boards */
+#define PERFT_MAX_DEPTH 32
+#define PERFT_MAX_THREADS 64
+#define PERFT_MAX_TABLE_BITS 27
+#define PERFT_PROBES 64
+/* Most placements of a tetromino, one for each rotation, row and column */
+#define MAX_PLACEMENTS (4 * GAME_BLOCK_HEIGHT * GAME_BLOCK_WIDTH)
+
+/* Arena mode: time between steps of the games (us), and the bytes and time
+ * (us) a frame may take. Tiles left over are drawn in the next frames */
+#define ARENA_TICK 50000
+#define ARENA_FRAME_BYTES 8192
+#define ARENA_FRAME_TIME 4000
+/* Estimated bytes to draw one cell of a tile: cursor movement, color and character */
+#define ARENA_CELL_BYTES 16
+/* Size of a tile with its border */
+#define TILE_LINES ((GAME_BLOCK_HEIGHT + 1) / 2 + 2)
+#define TILE_COLS (GAME_BLOCK_WIDTH + 2)
+/* Arena cell whose color on the screen isn't known, so it is always drawn */
+#define UNKNOWN_COLOR 0xff
+/* Positions the current tetromino can't reach in finesse mode */
+#define UNREACHED 0xff
+
+/* Buckets of the game loop latency histogram (us) */
+#define LATENCY_BUCKETS 12
+/* Seconds a metrics client has to send its request and read the reply */
+#define METRICS_TIMEOUT 1
+/* Adds N to a metric without ordering, readers only need each value to be consistent */
+#define METRIC_ADD(M, N) atomic_fetch_add_explicit(&metrics.M, (N), memory_order_relaxed)
+#define METRIC_GET(M) atomic_load_explicit(&metrics.M, memory_order_relaxed)
+#define METRIC_SET(M, N) atomic_store_explicit(&metrics.M, (N), memory_order_relaxed)
+
+/* Number of spans kept by the tracer per thread. Older spans are overwritten */
+#define TRACE_CAP 65536
+#define TRACE_THREADS 2
+/* Start and end a traced span. Both are no-ops unless tracing is enabled */
+#define TRACE_BEGIN(V) long V = trace_path ? now_usec() : 0
+#define TRACE_END(V, N, C)                \
+    do {                                  \
+        if (trace_path)                   \
+            trace_record((N), (C), (V));  \
+    } while (0)
+
 typedef struct Tblock Tblock;
 typedef struct Tetromino Tetromino;
 typedef struct Menu Menu;
 typedef struct Option Option;
 typedef struct Game Game;
-typedef struct TetroType TetroType;
-
-typedef enum TetroEnum {
-    NONE = 0,
-    I = 1,
-    S = 2,
-    O = 3,
-    T = 4,
-    L = 5
-} TetroEnum;
-
-struct TetroType {
-    TetroEnum type;
-    int spos[4][2];  /* Start Positions */
-    int ispos[4][2]; /* Inverted start positions */
-    int cpos;        /* Position of the blocks's center */
+typedef struct Piece Piece;
+typedef struct Rules Rules;
+typedef struct TraceSpan TraceSpan;
+typedef struct Output Output;
+typedef struct Snapshot Snapshot;
+typedef struct Checkpoint Checkpoint;
+typedef struct BoardStats BoardStats;
+typedef struct Metrics Metrics;
+typedef struct Orientation Orientation;
+typedef struct Kind Kind;
+typedef struct Batch Batch;
+typedef struct Perft Perft;
+typedef struct PerftThread PerftThread;
+
+/* Actions of the batched engine */
+typedef enum Action {
+    ACT_NONE = 0,
+    ACT_LEFT,
+    ACT_RIGHT,
+    ACT_ROTATE_LEFT,
+    ACT_ROTATE_RIGHT,
+    ACT_SOFT_DROP,
+    ACT_HARD_DROP,
+    ACTIONS
+} Action;
+
+struct Piece {
+    char name;      /* Letter of the piece in rule files and perft sequences */
+    int pos[4][2];  /* Start positions: column from the spawn column and row */
+    int cpos;       /* Position of the blocks's center */
+    int rotates;    /* 0 for pieces that don't rotate (O) */
+};
+
+/* Pieces, gravity and scoring of the game. Loaded from a file with -r */
+struct Rules {
+    Piece pieces[MAX_PIECES];
+    int npieces;
+    char names[MAX_PIECES + 1];  /* Names of the pieces, in order */
+    long gravity[MAX_LEVELS];    /* Time the tetromino takes to go down a row at each level (us) */
+    int nlevels;                 /* Levels after the last one use its gravity */
+    int points[5];               /* Points for deleting 0-4 lines, multiplied by the level */
+    int kicks[MAX_KICKS];        /* Columns tried when a rotation doesn't fit */
+    int nkicks;
+};
+
+struct TraceSpan {
+    const char* name; /* Name of the span */
+    const char* cat;  /* Category (input, sim, render, flush) */
+    long ts, dur;     /* Start time and duration in microseconds */
+};
+
+struct Output {            /* Output sent to the terminal */
+    int tty;               /* Terminal, -1 if the output isn't measured */
+    int pipe;              /* Read end of the pipe curses writes to */
+    pthread_t relay;       /* Thread that copies the pipe to the terminal */
+    atomic_ulong received; /* Bytes read from the pipe */
+    atomic_ulong sent;     /* Bytes written to the terminal */
+    atomic_long blocked;   /* Time spent blocked on writes (us) */
+    unsigned long drained; /* Bytes that already left the output queue */
+    double rate;           /* Rate at which the output drains (bytes/s) */
+    long frame_bytes;      /* Bytes written by the last frame */
+    long interval;         /* Minimum time between frames (us) */
+    long next_frame;       /* Earliest time to draw the next frame */
+    long sampled;          /* Time of the last rate sample */
+    unsigned long sframes; /* Frames drawn at the last rate sample */
+    long stats_time;       /* Next time the throughput shown is updated */
+    double fps;            /* Frames drawn per second */
+    unsigned long frames;  /* Frames drawn */
+};
+
+struct Metrics {                 /* Counters served on the metrics socket */
+    atomic_ulong frames;         /* Frames drawn */
+    atomic_ulong skipped;        /* Frames published but never drawn because the terminal was busy */
+    atomic_ulong curses_calls;   /* Estimate of the calls to curses made while drawing the game */
+    atomic_ulong ticks;          /* Gravity steps and automatic placements */
+    atomic_ulong inputs;         /* Keys handled by the game */
+    atomic_ulong clears[4];      /* Line clears by number of lines */
+    atomic_ulong started, ended; /* Games */
+    atomic_ulong latency[LATENCY_BUCKETS + 1]; /* Game loop iterations by duration */
+    atomic_ulong latency_sum;    /* Total duration of the game loop iterations (us) */
+    atomic_int height, holes, wells, transitions, bumpiness; /* Features of the board */
+};
+
+/* Tetromino in one rotation, relative to its center block */
+struct Orientation {
+    int cells[4][2];   /* Column and row of each block */
+    int minx, miny;    /* Top left corner of the bounding box */
+    int w, h;          /* Size of the bounding box */
+    uint16_t rows[4];  /* Blocks of each row of the bounding box, bit 0 is the left column */
+};
+
+/* Lookup tables of a tetromino kind for the engine */
+struct Kind {
+    Orientation rot[4];
+    int rotates;       /* 0 for tetrominos that don't rotate (O) */
+    int spawnc, spawnr; /* Center block at spawn, relative to the spawn column */
+};
+
+/* N independent games, each field in its own array. Rows are 0-based from
+ * the top and each board is contiguous, so row y of game g is
+ * rows[g * GAME_BLOCK_HEIGHT + y]. A move touches one or two cache lines */
+struct Batch {
+    int n;
+    uint16_t* rows;
+    unsigned char *kind, *rot, *next, *color;
+    signed char *x, *y; /* Center block of the tetromino, 0-based */
+    unsigned int* seed;
+    unsigned int* points;
+    int *lines, *cleared;
+    unsigned char* done;
+    unsigned long steps; /* Steps made by all the games */
+};
+
+/* Shared state of a perft run */
+struct Perft {
+    const char* seq;                          /* Kind of the tetromino of each depth */
+    int depth;
+    _Atomic uint64_t* table;                  /* Hashes of the boards seen, 0 when empty */
+    uint64_t mask;
+    uint16_t (*roots)[GAME_BLOCK_HEIGHT];     /* Boards after the first tetromino */
+    int nroots;
+    atomic_int nextroot;                      /* Next root a thread takes */
+    atomic_int full;                          /* The table ran out of space */
+};
+
+/* Counters of a perft thread, summed at the end */
+struct PerftThread {
+    pthread_t id;
+    unsigned long nodes[PERFT_MAX_DEPTH + 1]; /* New boards found at each depth */
+    unsigned long placements;                 /* Boards generated, including repeated ones */
 };
 
 struct Menu {
@@ -73,8 +281,7 @@ struct Menu {
 };
 
 struct Tetromino {
-    TetroEnum type;
-    int inv;
+    int type; /* Index of the piece in the rules plus one, NONE if there isn't any */
     int color;
 };
 
@@ -84,6 +291,31 @@ struct Tblock {     /* Tetromino block */
     Tblock* center; /* Center of the tetromino*/
 };
 
+/* Features of the placed blocks, kept up to date on every placement and
+ * deleted row. The current tetromino isn't included */
+struct BoardStats {
+    uint32_t cols[GAME_BLOCK_WIDTH + 1];  /* Blocks of each column, bit r is row r */
+    int heights[GAME_BLOCK_WIDTH + 1];    /* Rows from the bottom to the top block of each column */
+    int colholes[GAME_BLOCK_WIDTH + 1];   /* Empty cells under the top block of each column */
+    int height;      /* Height of the tallest column */
+    int holes;       /* Empty cells under the top block of their column */
+    int wells;       /* Sum of how much lower each column is than both neighbors (walls are full) */
+    int transitions; /* Changes between empty and full cells along the rows (walls are full) */
+    int bumpiness;   /* Sum of the height differences between neighbor columns */
+};
+
+/* State of the game when a tetromino spawns, to rewind to it */
+struct Checkpoint {
+    unsigned char blocks[GAME_BLOCK_WIDTH + 1][GAME_BLOCK_HEIGHT + 1];
+    unsigned char sel[4][2]; /* Column and row of the selected blocks */
+    unsigned char center;    /* Index of the center block */
+    Tetromino ct, nt, oh;
+    int canhold, level, lines;
+    unsigned int points;
+    unsigned int seed;
+    BoardStats board;
+};
+
 struct Game {
     /* Block matrix. The blocks start counting at index 1 */
     int blocks[GAME_BLOCK_WIDTH + 1][GAME_BLOCK_HEIGHT + 1];
@@ -93,22 +325,49 @@ struct Game {
     Tetromino nt;        /* Next tetromino */
     Tetromino ct;        /* Current tetromino */
     Tetromino oh;        /* Tetromino on hold */
-    clock_t timer;       /* Timer to move the tetromino down automatically */
-    clock_t groundtimer; /* Timer to automatically place the tetromino on the ground  */
+    long timer;          /* Timer to move the tetromino down automatically */
+    long groundtimer;    /* Timer to automatically place the tetromino on the ground  */
     int canhold;         /* If the player can put the current tetromino on hold */
     int isrunning;
     int isover;
     int level;
     int lines; /* Number of lines deleted */
     unsigned int points;
+    unsigned long frame; /* Number of frames published */
+    unsigned long stats; /* Incremented when the stats change */
+    unsigned int seed;   /* State of the random generator */
+    /* Ring buffer with the last placements, for practice mode */
+    Checkpoint rewind[REWIND_SLOTS];
+    int rewindpos; /* Index of the newest checkpoint */
+    int rewindlen; /* Number of checkpoints saved */
+    /* Fewest inputs that bring the current tetromino to each rotation, row
+     * and column since it spawned, for finesse mode. UNREACHED if it can't */
+    unsigned char reach[4][GAME_BLOCK_HEIGHT][GAME_BLOCK_WIDTH];
+    BoardStats board; /* Features of the placed blocks */
+    int presses; /* Inputs pressed for the current tetromino */
+    int excess;  /* Inputs over the fewest needed for the last tetromino */
+    int faults;  /* Sum of the inputs over the fewest needed */
+};
+
+/* Immutable copy of the game published for the renderer */
+struct Snapshot {
+    unsigned char blocks[GAME_BLOCK_WIDTH + 1][GAME_BLOCK_HEIGHT + 1]; /* With the placement preview */
+    Tetromino nt, oh;
+    unsigned int points;
+    int level, lines, isover;
+    int excess, faults;
+    BoardStats board;
+    unsigned long frame, stats;
 };
 
 static void draw_menu(WINDOW* menuwin, Menu menu);
 static void run_game(Game* game);
-static void draw_game_box(Game* game);
+static void draw_game_box(WINDOW* win, const Snapshot* snap);
 static void draw_game_over(Game* game);
-static void draw_game_stats(Game* game);
+static void draw_game_stats(WINDOW* menuwin, const Snapshot* snap);
+static void draw_stats_line(WINDOW* menuwin, int row, const char* text);
 static void draw_tetromino(WINDOW* win, Tetromino t, int y, int x);
+static void draw_half_blocks(WINDOW* win, int y, int x, int top, int bottom, int width);
 static void select_block(Game* game, int c, int r, int bn);
 static void place_tetromino(Game* game);
 static int try_spawn(Game* game, Tetromino t);
@@ -118,25 +377,113 @@ static void descend_blocks(Game* game, int sr);
 static void delete_tetromino(Game* game);
 static void delete_row(Game* game, int rn);
 static void put_on_hold(Game* game);
-static void show_placed_tetromino(Game* game);
+static void publish_frame(Game* game);
+static void render_frame(Game* game);
+static void* simulate(void* arg);
+static int next_key(Game* game);
+static void idle();
 static void delete_full_rows(Game* game);
 static void resize_handler();
 static void try_rotate(Game* game, int d);
+static void kick_rotate(Game* game, int d);
 static void update_downtime(Game* game);
 static int is_over(Game* game, Tetromino t);
 static int check_move(Game* game, int h, int v);
-static int is_selected(Game* game, int* b);
 static Menu start_menu(WINDOW* menuwin);
 static void create_game(Game* game, WINDOW* gwin);
 static WINDOW* create_game_window();
 static WINDOW* create_menu_window();
 static WINDOW* create_newwin(int heightm, int width, int starty, int startx);
-static Tetromino gentetromino(Tetromino prev);
+static Tetromino gentetromino(unsigned int* seed, Tetromino prev);
+static unsigned int next_random(unsigned int* seed);
+static unsigned int split_seed(unsigned int seed, int i);
+static void open_metrics();
+static void close_metrics();
+static void* serve_metrics(void* arg);
+static int format_metrics(char* buf, int size);
+static void observe_latency(long us);
+static void save_checkpoint(Game* game);
+static int rewind_game(Game* game);
+static void rule_error(const char* path, int line, const char* msg);
+static long rule_number(const char* path, int line, const char* word);
+static void load_rules(const char* path);
+static void load_board(const char* path, uint16_t* rows);
+static void init_kinds();
+static void clear_board_stats(BoardStats* bs);
+static int row_transitions(const BoardStats* bs, int r);
+static void update_column_stats(BoardStats* bs, int c);
+static void update_surface_stats(BoardStats* bs);
+static void add_board_blocks(BoardStats* bs, const Tblock* blocks);
+static void delete_board_row(BoardStats* bs, int r);
+static const BoardStats* board_stats(const Game* game);
+static int piece_fits(const uint16_t* rows, const Orientation* o, int x, int y);
+static int lock_piece(uint16_t* rows, const Orientation* o, int x, int y);
+static int spawn_piece(const uint16_t* rows, int kind, int* x, int* y);
+static void move_piece(const uint16_t* rows, int kind, int* rot, int* x, int* y, Action a);
+static int next_kind(unsigned int* seed);
+static Batch* batch_create(int n, unsigned int seed);
+static void batch_free(Batch* b);
+static void batch_reset(Batch* b, int g);
+static void batch_step(Batch* b, const unsigned char* actions, uint16_t* obs);
+static void bench_batch(int n);
+static int placements(const uint16_t* rows, int kind, uint16_t (*boards)[GAME_BLOCK_HEIGHT]);
+static uint64_t hash_board(const uint16_t* rows, int depth);
+static int perft_insert(uint64_t key);
+static void perft_node(PerftThread* t, const uint16_t* rows, int depth);
+static void* perft_worker(void* arg);
+static void run_perft(const char* seq, const uint16_t* board);
+static void plan_finesse(Game* game);
+static void score_finesse(Game* game);
+static void draw_arena_tiles(int n);
+static int draw_arena(Batch* b);
+static void run_arena(int n);
+static long now_usec();
+static void trace_record(const char* name, const char* cat, long start);
+static void trace_dump();
+static void* relay_output(void* arg);
+static void open_output();
+static void close_output();
+static unsigned long written_output();
+static long pending_output();
+static void sample_output();
+static int frame_ready();
+static void end_frame(unsigned long bytes, long blocked);
 
 /* Static variables */
 static WINDOW *game_window, *menu_window;
 static Menu menu;
 static Game game;
+static int compact;            /* Draw blocks with half-block characters */
+static int threaded = 1;       /* Run the game logic and the rendering on separate threads */
+static int practice;           /* Allow undoing placements */
+static int finesse;            /* Count the inputs over the fewest needed for each placement */
+static int arena;              /* Number of games shown in arena mode, 0 to play */
+/* Colors shown on each cell of the arena, UNKNOWN_COLOR when unknown, and the
+ * lines shown on each tile */
+static unsigned char* arena_shown;
+static int* arena_lines;
+static int arena_next; /* Tile where the next frame starts drawing */
+/* Triple buffer of snapshots. The game thread fills snap_back, the renderer
+ * draws snap_front and snap_latest holds the newest one (and SNAP_FRESH) */
+static Snapshot snaps[3];
+static int snap_back = 1, snap_front = 0;
+static atomic_int snap_latest = 2;
+/* Keys read by the render thread for the game thread */
+static int input_buf[INPUT_CAP];
+static atomic_uint input_head, input_tail;
+static atomic_int sim_done; /* The game thread finished */
+static const char* trace_path; /* Where to dump the trace, NULL if disabled */
+static TraceSpan trace_buf[TRACE_THREADS][TRACE_CAP];
+static unsigned long trace_n[TRACE_THREADS]; /* Total number of spans recorded */
+static _Thread_local int trace_tid;          /* Ring buffer of the current thread */
+static Output output;
+static const char* metrics_path; /* Socket serving the metrics, NULL if disabled */
+static int metrics_fd = -1;
+static Metrics metrics;
+static Kind kinds[MAX_PIECES];
+static Perft perft;
+/* Upper bounds of the latency buckets (us), the last one is +Inf */
+static const long latency_bounds[LATENCY_BUCKETS] = {5, 10, 25, 50, 100, 250, 500, 1000, 2500, 5000, 10000, 25000};
 
 /* Positions for the different types of tetrominos */
 #define I_POS {{0, 1}, {0, 2}, {0, 3}, {0, 4}}
@@ -152,21 +499,338 @@ static Game game;
 #define Inv_s_POS {{-1, 2}, {0, 1}, {0, 2}, {1, 1}}
 #define Inv_l_POS {{0, 1}, {0, 2}, {0, 3}, {1, 1}}
 
-/* Define the different tetromino types */
-static const TetroType types[] = {
-    {I, I_POS, Inv_i_POS, 2},
-    {S, S_POS, Inv_s_POS, 2},
-    {O, O_POS, Inv_o_POS, 0},
-    {T, T_POS, Inv_t_POS, 1},
-    {L, L_POS, Inv_l_POS, 1}};
-
-#define T_COL(T, N) ((T).inv ? types[(T).type - 1].ispos[N][0] : types[(T).type - 1].spos[N][0])
-#define T_ROW(T, N) ((T).inv ? types[(T).type - 1].ispos[N][1] : types[(T).type - 1].spos[N][1])
-#define T_CEN(T) (types[(T).type - 1].cpos)
+/* Built-in rules: five tetrominos and their inverted versions, all equally likely */
+static Rules rules = {
+    .pieces = {{'I', I_POS, 2, 1},
+               {'i', Inv_i_POS, 2, 1},
+               {'S', S_POS, 2, 1},
+               {'s', Inv_s_POS, 2, 1},
+               {'O', O_POS, 0, 0},
+               {'o', Inv_o_POS, 0, 0},
+               {'T', T_POS, 1, 1},
+               {'t', Inv_t_POS, 1, 1},
+               {'L', L_POS, 1, 1},
+               {'l', Inv_l_POS, 1, 1}},
+    .npieces = 10,
+    .gravity = {DEFAULT_GSPEED(1), DEFAULT_GSPEED(2), DEFAULT_GSPEED(3), DEFAULT_GSPEED(4),
+                DEFAULT_GSPEED(5), DEFAULT_GSPEED(6), DEFAULT_GSPEED(7), DEFAULT_GSPEED(8),
+                DEFAULT_GSPEED(9), DEFAULT_GSPEED(10), DEFAULT_GSPEED(11), DEFAULT_GSPEED(12),
+                DEFAULT_GSPEED(13), DEFAULT_GSPEED(14), DEFAULT_GSPEED(15), DEFAULT_GSPEED(16),
+                DEFAULT_GSPEED(17), DEFAULT_GSPEED(18), DEFAULT_GSPEED(19), DEFAULT_GSPEED(20)},
+    .nlevels = MAX_SPEED_LEVEL,
+    .points = {0, POINTS_1_LINES, POINTS_2_LINES, POINTS_3_LINES, POINTS_4_LINES},
+    .kicks = {-1, 1, -2, 2},
+    .nkicks = 4};
+
+#define T_COL(T, N) (rules.pieces[(T).type - 1].pos[N][0])
+#define T_ROW(T, N) (rules.pieces[(T).type - 1].pos[N][1])
+#define T_CEN(T) (rules.pieces[(T).type - 1].cpos)
 
 /* Positions that are going to be tested (from left to right) each time the game tries to place the tetromino */
 static const int try_pos[10] = {5, 6, 4, 7, 3, 8, 2, 9, 1, 10};
 
+/* Monotonic time in microseconds */
+long now_usec() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000L + ts.tv_nsec / 1000;
+}
+
+/* Records a span that started at start and ends now in the ring buffer */
+void trace_record(const char* name, const char* cat, long start) {
+    TraceSpan* sp = &trace_buf[trace_tid][trace_n[trace_tid]++ % TRACE_CAP];
+    sp->name = name;
+    sp->cat = cat;
+    sp->ts = start;
+    sp->dur = now_usec() - start;
+}
+
+/* Writes the recorded spans as Chrome trace-event JSON */
+void trace_dump() {
+    FILE* f;
+    int first = 1;
+    if (!(f = fopen(trace_path, "w"))) {
+        perror(trace_path);
+        return;
+    }
+    fprintf(f, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+    for (int t = 0; t < TRACE_THREADS; t++)
+        for (unsigned long i = trace_n[t] > TRACE_CAP ? trace_n[t] - TRACE_CAP : 0; i < trace_n[t]; i++, first = 0) {
+            TraceSpan* sp = &trace_buf[t][i % TRACE_CAP];
+            fprintf(f, "%s\n{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%ld,\"dur\":%ld,\"pid\":1,\"tid\":%d}",
+                    first ? "" : ",", sp->name, sp->cat, sp->ts, sp->dur, t + 1);
+        }
+    fprintf(f, "\n]}\n");
+    fclose(f);
+}
+
+/* Copies curses' output from the pipe to the terminal, counting it. If the
+ * terminal fails, the output is still read and thrown away, so curses never
+ * blocks on a full pipe */
+void* relay_output(void* arg) {
+    char buf[BUFSIZ * 4];
+    ssize_t n, w;
+    long start;
+    int failed = 0; /* The terminal can't be written to */
+
+    while ((n = read(output.pipe, buf, sizeof(buf))) != 0) {
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+        atomic_fetch_add(&output.received, n);
+        if (failed)
+            continue;
+        start = now_usec();
+        for (ssize_t done = 0; done < n; done += w)
+            if ((w = write(output.tty, buf + done, n - done)) < 0) {
+                if (errno != EINTR) {
+                    failed = 1;
+                    break;
+                }
+                w = 0;
+            }
+        if (failed)
+            continue;
+        atomic_fetch_add(&output.blocked, now_usec() - start);
+        atomic_fetch_add(&output.sent, n);
+    }
+    return NULL;
+}
+
+/* Makes curses write to a pipe that a thread relays to the terminal, so the
+ * output can be measured. Curses controls the terminal through stderr when
+ * stdout isn't a tty, so this is only done when stderr is the terminal */
+void open_output() {
+    int fds[2];
+
+    output.tty = -1;
+    if (!isatty(STDOUT_FILENO) || !isatty(STDERR_FILENO) || pipe(fds))
+        return;
+    output.tty = dup(STDOUT_FILENO);
+    output.pipe = fds[0];
+    dup2(fds[1], STDOUT_FILENO);
+    close(fds[1]);
+    if (pthread_create(&output.relay, NULL, relay_output, NULL)) {
+        dup2(output.tty, STDOUT_FILENO);
+        close(output.tty);
+        close(output.pipe);
+        output.tty = -1;
+        return;
+    }
+    atexit(close_output);
+}
+
+/* Gives stdout back to the terminal and waits until all the output is sent */
+void close_output() {
+    fflush(stdout);
+    /* Closes the pipe, so the relay stops after sending what's left */
+    dup2(output.tty, STDOUT_FILENO);
+    pthread_join(output.relay, NULL);
+}
+
+/* Bytes curses has written so far */
+unsigned long written_output() {
+    int n = 0;
+    if (output.tty < 0)
+        return 0;
+    ioctl(output.pipe, FIONREAD, &n);
+    return atomic_load(&output.received) + n;
+}
+
+/* Bytes written that haven't reached the terminal yet */
+long pending_output() {
+    long n = written_output() - atomic_load(&output.sent);
+#ifdef TIOCOUTQ
+    int q;
+    if (output.tty >= 0 && ioctl(output.tty, TIOCOUTQ, &q) == 0)
+        n += q;
+#endif
+    return n;
+}
+
+/* Updates the rate at which the output drains */
+void sample_output() {
+    long now = now_usec();
+    long dt = now - output.sampled;
+    unsigned long sent = written_output() - pending_output();
+
+    if (dt < RATE_WINDOW)
+        return;
+    if (sent < output.drained)
+        sent = output.drained;
+    /* Exponential moving average over a few windows */
+    output.rate = output.rate * 0.5 + (sent - output.drained) * 1e6 / dt * 0.5;
+    output.drained = sent;
+    output.fps = (output.frames - output.sframes) * 1e6 / dt;
+    output.sframes = output.frames;
+    output.sampled = now;
+}
+
+/* Checks if a new frame can be drawn without queuing behind the previous ones */
+int frame_ready() {
+    if (now_usec() < output.next_frame)
+        return 0;
+    return pending_output() <= output.frame_bytes / 2;
+}
+
+/* Accounts a frame that wrote bytes and blocked during blocked us, and
+ * decides when the next one can be drawn */
+void end_frame(unsigned long bytes, long blocked) {
+    long pending = pending_output();
+    long drain; /* Time needed to send what is still queued (us) */
+
+    output.frames++;
+    output.frame_bytes = bytes;
+    sample_output();
+    if (pending > 0 && output.rate > 0)
+        drain = (long) (pending * 1e6 / output.rate);
+    else
+        drain = blocked;
+    /* Slow down fast when the terminal falls behind, recover slowly */
+    if (drain > output.interval)
+        output.interval = drain;
+    else
+        output.interval = output.interval * 3 / 4;
+    if (output.interval > MAX_FRAME_INTERVAL)
+        output.interval = MAX_FRAME_INTERVAL;
+    output.next_frame = now_usec() + output.interval;
+}
+
+/* Counts a game loop iteration that took us microseconds */
+void observe_latency(long us) {
+    int b = 0;
+    while (b < LATENCY_BUCKETS && us > latency_bounds[b])
+        b++;
+    METRIC_ADD(latency[b], 1);
+    METRIC_ADD(latency_sum, us);
+}
+
+/* Writes the metrics in Prometheus text format. Returns the length */
+int format_metrics(char* buf, int size) {
+    unsigned long cum = 0;
+    int n = 0;
+
+#define PUT(...) n += snprintf(buf + n, n < size ? size - n : 0, __VA_ARGS__)
+    PUT("# HELP termetris_frames_rendered_total Frames drawn.\n"
+        "# TYPE termetris_frames_rendered_total counter\n"
+        "termetris_frames_rendered_total %lu\n", METRIC_GET(frames));
+    PUT("# HELP termetris_frames_skipped_total Frames never drawn because the terminal was busy.\n"
+        "# TYPE termetris_frames_skipped_total counter\n"
+        "termetris_frames_skipped_total %lu\n", METRIC_GET(skipped));
+    PUT("# HELP termetris_curses_calls_estimated_total Estimate of the calls to curses made while drawing the game.\n"
+        "# TYPE termetris_curses_calls_estimated_total counter\n"
+        "termetris_curses_calls_estimated_total %lu\n", METRIC_GET(curses_calls));
+    PUT("# HELP termetris_bytes_written_total Bytes written to the terminal.\n"
+        "# TYPE termetris_bytes_written_total counter\n"
+        "termetris_bytes_written_total %lu\n", atomic_load(&output.sent));
+    PUT("# HELP termetris_ticks_total Gravity steps and automatic placements.\n"
+        "# TYPE termetris_ticks_total counter\n"
+        "termetris_ticks_total %lu\n", METRIC_GET(ticks));
+    PUT("# HELP termetris_input_events_total Keys handled by the game.\n"
+        "# TYPE termetris_input_events_total counter\n"
+        "termetris_input_events_total %lu\n", METRIC_GET(inputs));
+    PUT("# HELP termetris_line_clears_total Line clears by number of lines.\n"
+        "# TYPE termetris_line_clears_total counter\n");
+    for (int i = 0; i < 4; i++)
+        PUT("termetris_line_clears_total{lines=\"%d\"} %lu\n", i + 1, METRIC_GET(clears[i]));
+    PUT("# HELP termetris_games_started_total Games started.\n"
+        "# TYPE termetris_games_started_total counter\n"
+        "termetris_games_started_total %lu\n", METRIC_GET(started));
+    PUT("# HELP termetris_games_ended_total Games ended.\n"
+        "# TYPE termetris_games_ended_total counter\n"
+        "termetris_games_ended_total %lu\n", METRIC_GET(ended));
+    PUT("# HELP termetris_loop_latency_seconds Duration of the game loop iterations that did work.\n"
+        "# TYPE termetris_loop_latency_seconds histogram\n");
+    for (int b = 0; b < LATENCY_BUCKETS; b++) {
+        cum += METRIC_GET(latency[b]);
+        PUT("termetris_loop_latency_seconds_bucket{le=\"%g\"} %lu\n", latency_bounds[b] / 1e6, cum);
+    }
+    cum += METRIC_GET(latency[LATENCY_BUCKETS]);
+    PUT("termetris_loop_latency_seconds_bucket{le=\"+Inf\"} %lu\n", cum);
+    PUT("termetris_loop_latency_seconds_sum %g\n", METRIC_GET(latency_sum) / 1e6);
+    PUT("termetris_loop_latency_seconds_count %lu\n", cum);
+    PUT("# HELP termetris_board_height Height of the tallest column.\n"
+        "# TYPE termetris_board_height gauge\n"
+        "termetris_board_height %d\n", METRIC_GET(height));
+    PUT("# HELP termetris_board_holes Empty cells under the top block of their column.\n"
+        "# TYPE termetris_board_holes gauge\n"
+        "termetris_board_holes %d\n", METRIC_GET(holes));
+    PUT("# HELP termetris_board_wells Sum of the depths of the wells.\n"
+        "# TYPE termetris_board_wells gauge\n"
+        "termetris_board_wells %d\n", METRIC_GET(wells));
+    PUT("# HELP termetris_board_row_transitions Changes between empty and full cells along the rows.\n"
+        "# TYPE termetris_board_row_transitions gauge\n"
+        "termetris_board_row_transitions %d\n", METRIC_GET(transitions));
+    PUT("# HELP termetris_board_bumpiness Sum of the height differences between neighbor columns.\n"
+        "# TYPE termetris_board_bumpiness gauge\n"
+        "termetris_board_bumpiness %d\n", METRIC_GET(bumpiness));
+#undef PUT
+    return n < size ? n : size - 1;
+}
+
+/* Answers every connection to the metrics socket with the current metrics */
+void* serve_metrics(void* arg) {
+    char req[1024], body[8192], head[128];
+    struct timeval timeout = {METRICS_TIMEOUT, 0};
+    int fd, len;
+
+    while ((fd = accept(metrics_fd, NULL, NULL)) >= 0 || errno == EINTR) {
+        if (fd < 0)
+            continue;
+        /* A client that sends nothing or doesn't read can't hold up the next ones */
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+        /* The request doesn't matter, there's only one page */
+        read(fd, req, sizeof(req));
+        len = format_metrics(body, sizeof(body));
+        snprintf(head, sizeof(head),
+                 "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %d\r\n\r\n", len);
+        /* MSG_NOSIGNAL: a client that already left must not kill the game with SIGPIPE */
+        if (send(fd, head, strlen(head), MSG_NOSIGNAL) > 0)
+            send(fd, body, len, MSG_NOSIGNAL);
+        close(fd);
+    }
+    return NULL;
+}
+
+/* Starts serving the metrics on a Unix socket */
+void open_metrics() {
+    struct sockaddr_un addr = {0};
+    struct stat st;
+    pthread_t server;
+
+    if (strlen(metrics_path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "%s: socket path too long\n", metrics_path);
+        exit(EXIT_FAILURE);
+    }
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, metrics_path);
+    /* Replace a socket left by an earlier run, but never anything else */
+    if (!lstat(metrics_path, &st)) {
+        if (!S_ISSOCK(st.st_mode)) {
+            fprintf(stderr, "%s: exists and isn't a socket\n", metrics_path);
+            exit(EXIT_FAILURE);
+        }
+        unlink(metrics_path);
+    }
+    if ((metrics_fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0 ||
+        bind(metrics_fd, (struct sockaddr*) &addr, sizeof(addr)) ||
+        listen(metrics_fd, 4) ||
+        pthread_create(&server, NULL, serve_metrics, NULL)) {
+        perror(metrics_path);
+        exit(EXIT_FAILURE);
+    }
+    pthread_detach(server);
+    atexit(close_metrics);
+}
+
+/* Removes the metrics socket */
+void close_metrics() {
+    unlink(metrics_path);
+}
+
 /* Check if a tetromino can spawn in a position */
 int can_spawn(Game* game, Tetromino t, int sp) {
     int c, r;
@@ -175,7 +839,7 @@ int can_spawn(Game* game, Tetromino t, int sp) {
     for (int i = 0; i < 4; i++) {
         c = T_COL(t, i) + sp;
         r = T_ROW(t, i);
-        if (c > GAME_BLOCK_WIDTH + 1 || c < 1 || r > GAME_BLOCK_HEIGHT + 1 || r < 1)
+        if (c > GAME_BLOCK_WIDTH || c < 1 || r > GAME_BLOCK_HEIGHT || r < 1)
             return 0;
         else if (game->blocks[c][r])
             return 0;
@@ -196,17 +860,21 @@ void spawn_tetromino(Game* game, Tetromino t, int sp) {
         game->selblocks[i].center = &game->selblocks[T_CEN(t)];
     }
     game->ct = t;
-    wrefresh(game->win);
 }
 
 /* Tries to spawn a tetromino in all positions. Returns 1 on success, 0 on failure. */
 int try_spawn(Game* game, Tetromino t) {
-    for (int i = 0; i < 10; i++)
+    TRACE_BEGIN(start);
+    int spawned = 0;
+    for (int i = 0; i < 10 && !spawned; i++)
         if (can_spawn(game, t, try_pos[i])) {
             spawn_tetromino(game, t, try_pos[i]);
-            return 1;
+            spawned = 1;
         }
-    return 0;
+    TRACE_END(start, "try_spawn", "sim");
+    if (spawned && finesse)
+        plan_finesse(game);
+    return spawned;
 }
 
 /* Check if the game is over assuming t is the next tetromino */
@@ -219,15 +887,89 @@ int is_over(Game* game, Tetromino t) {
     return 1;
 }
 
+/* Advances a xorshift generator. Each game has its own so it can be rewound */
+unsigned int next_random(unsigned int* seed) {
+    *seed ^= *seed << 13;
+    *seed ^= *seed >> 17;
+    *seed ^= *seed << 5;
+    return *seed;
+}
+
+/* Seed i of a set of generators started from one seed, mixed with splitmix64
+ * so their streams don't overlap. Never 0, where xorshift would stay */
+unsigned int split_seed(unsigned int seed, int i) {
+    uint64_t z = seed + (uint64_t) (i + 1) * 0x9e3779b97f4a7c15ULL;
+
+    z = (z ^ z >> 30) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ z >> 27) * 0x94d049bb133111ebULL;
+    z ^= z >> 31;
+    z ^= z >> 32;
+    return (unsigned int) z ? (unsigned int) z : 1;
+}
+
 /* Generates a next tetromino assuming prev is the previous one */
-Tetromino gentetromino(Tetromino prev) {
+Tetromino gentetromino(unsigned int* seed, Tetromino prev) {
     Tetromino t;
-    t.inv = rand() % 2;
-    t.type = rand() % 5 + 1;
+    t.type = next_random(seed) % rules.npieces + 1;
     t.color = NCOLOR(prev.color);
     return t;
 }
 
+/* Saves the state of the game in the rewind ring buffer, overwriting the oldest one */
+void save_checkpoint(Game* game) {
+    Checkpoint* cp;
+
+    game->rewindpos = (game->rewindpos + 1) % REWIND_SLOTS;
+    if (game->rewindlen < REWIND_SLOTS)
+        game->rewindlen++;
+    cp = &game->rewind[game->rewindpos];
+    for (int c = 0; c <= GAME_BLOCK_WIDTH; c++)
+        for (int r = 0; r <= GAME_BLOCK_HEIGHT; r++)
+            cp->blocks[c][r] = game->blocks[c][r];
+    for (int i = 0; i <= 3; i++) {
+        cp->sel[i][0] = game->selblocks[i].c;
+        cp->sel[i][1] = game->selblocks[i].r;
+    }
+    cp->center = game->selblocks[0].center - game->selblocks;
+    cp->ct = game->ct;
+    cp->nt = game->nt;
+    cp->oh = game->oh;
+    cp->canhold = game->canhold;
+    cp->level = game->level;
+    cp->lines = game->lines;
+    cp->points = game->points;
+    cp->seed = game->seed;
+    cp->board = game->board;
+}
+
+/* Goes back to when the previous tetromino spawned. Returns 0 if there isn't any */
+int rewind_game(Game* game) {
+    Checkpoint* cp;
+
+    if (game->rewindlen < 2)
+        return 0;
+    game->rewindlen--;
+    game->rewindpos = (game->rewindpos + REWIND_SLOTS - 1) % REWIND_SLOTS;
+    cp = &game->rewind[game->rewindpos];
+    for (int c = 0; c <= GAME_BLOCK_WIDTH; c++)
+        for (int r = 0; r <= GAME_BLOCK_HEIGHT; r++)
+            game->blocks[c][r] = cp->blocks[c][r];
+    for (int i = 0; i <= 3; i++) {
+        select_block(game, cp->sel[i][0], cp->sel[i][1], i);
+        game->selblocks[i].center = &game->selblocks[cp->center];
+    }
+    game->ct = cp->ct;
+    game->nt = cp->nt;
+    game->oh = cp->oh;
+    game->canhold = cp->canhold;
+    game->level = cp->level;
+    game->lines = cp->lines;
+    game->points = cp->points;
+    game->seed = cp->seed;
+    game->board = cp->board;
+    return 1;
+}
+
 /* Delete a row */
 void delete_row(Game* game, int rn) {
     for (int c = 1; c <= GAME_BLOCK_WIDTH; c++)
@@ -236,10 +978,10 @@ void delete_row(Game* game, int rn) {
 
 /* Updates the downtimer of the game */
 void update_downtime(Game* game) {
-    if (!check_move(game, 0, 1) && clock() > game->groundtimer)
-        game->groundtimer = clock() + CLOCKS_PER_SEC;
+    if (!check_move(game, 0, 1) && now_usec() > game->groundtimer)
+        game->groundtimer = now_usec() + 1000000L;
     else if (check_move(game, 0, 1))
-        game->groundtimer = clock();
+        game->groundtimer = now_usec();
 }
 
 /* Puts the current tetromino on hold */
@@ -258,7 +1000,7 @@ void put_on_hold(Game* game) {
         /* If there isn't */
     } else {
         game->oh = game->ct;
-        game->nt = gentetromino(game->ct);
+        game->nt = gentetromino(&game->seed, game->ct);
         delete_tetromino(game);
         if (!try_spawn(game, game->nt)) {
             game->isover = 1;
@@ -280,72 +1022,93 @@ void descend_blocks(Game* game, int sr) {
 /* Delete all rows that are full and updates the game structure */
 void delete_full_rows(Game* game) {
 
-    int r, c;
-    int del;    /* If a line was deleted */
-    int dl = 0; /* Deleted lines */
+    TRACE_BEGIN(start);
+    uint32_t full = ~0u; /* Rows with blocks in every column */
+    int dl = 0;          /* Deleted lines */
 
-    for (r = 1; r <= GAME_BLOCK_HEIGHT; r++) {
-        del = 1;
-        for (c = 1; c <= GAME_BLOCK_WIDTH; c++)
-            if (game->blocks[c][r] == COLOR_BLACK)
-                del = 0;
-        if (del) {
+    for (int c = 1; c <= GAME_BLOCK_WIDTH; c++)
+        full &= game->board.cols[c];
+    for (int r = 1; r <= GAME_BLOCK_HEIGHT; r++) {
+        if (full >> r & 1) {
             /* Delete the row */
             delete_row(game, r);
             /* Move blocks down */
             descend_blocks(game, r - 1);
+            delete_board_row(&game->board, r);
             dl++;
         }
     }
+    if (dl)
+        update_surface_stats(&game->board);
     /* Update the game's structure */
     if (dl) {
-        switch (dl) {
-        case 1:
-            game->points += (POINTS_1_LINES * game->level);
-            break;
-        case 2:
-            game->points += (POINTS_2_LINES * game->level);
-            break;
-        case 3:
-            game->points += (POINTS_3_LINES * game->level);
-            break;
-        default:
-            game->points += (POINTS_4_LINES * game->level);
-            break;
-        }
+        game->points += rules.points[dl > 4 ? 4 : dl] * game->level;
+        METRIC_ADD(clears[dl > 4 ? 3 : dl - 1], 1);
         game->lines += dl;
         game->level = (int) ((game->lines / 10) + 1);
     }
+    TRACE_END(start, "delete_full_rows", "sim");
 }
 
-/* Shows the current tetromino placed and refreshes the screen */
-void show_placed_tetromino(Game* game) {
+/* Publishes a snapshot of the game, with the placement preview, to be drawn */
+void publish_frame(Game* game) {
 
+    Snapshot* snap = &snaps[snap_back];
     int db = 0; /* Nº of blocks down */
-    int* b[4];  /* Buffer for the plocks */
-
-    /* Check how far the tetromino goes */
-    for (db = 0; check_move(game, 0, 1); move_tetromino(game, 0, 1), db++)
-        ;
 
-    for (int i = 0; i <= 3; i++)
-        b[i] = game->selblocks[i].ptr;
-    move_tetromino(game, 0, -db);
-    for (int i = 0; i <= 3; i++)
-        if (!is_selected(game, b[i]))
-            *b[i] = 5;
-    REF_GAME(game);
-    for (int i = 0; i <= 3; i++)
-        if (!is_selected(game, b[i]))
-            *b[i] = 0;
+    for (int c = 0; c <= GAME_BLOCK_WIDTH; c++)
+        for (int r = 0; r <= GAME_BLOCK_HEIGHT; r++)
+            snap->blocks[c][r] = game->blocks[c][r];
+    /* Check how far the tetromino goes and show it there */
+    if (game->selblocks[0].ptr) {
+        while (check_move(game, 0, db + 1))
+            db++;
+        for (int i = 0; i <= 3; i++)
+            if (!snap->blocks[game->selblocks[i].c][game->selblocks[i].r + db])
+                snap->blocks[game->selblocks[i].c][game->selblocks[i].r + db] = 5;
+    }
+    snap->nt = game->nt;
+    snap->oh = game->oh;
+    snap->points = game->points;
+    snap->level = game->level;
+    snap->lines = game->lines;
+    snap->isover = game->isover;
+    snap->excess = game->excess;
+    snap->board = *board_stats(game);
+    METRIC_SET(height, snap->board.height);
+    METRIC_SET(holes, snap->board.holes);
+    METRIC_SET(wells, snap->board.wells);
+    METRIC_SET(transitions, snap->board.transitions);
+    METRIC_SET(bumpiness, snap->board.bumpiness);
+    snap->faults = game->faults;
+    snap->frame = ++game->frame;
+    snap->stats = game->stats;
+    snap_back = atomic_exchange(&snap_latest, snap_back | SNAP_FRESH) & ~SNAP_FRESH;
+    if (!threaded)
+        render_frame(game);
 }
 
-/* Checks if a block is currently selected */
-int is_selected(Game* game, int* b) {
-    for (int i = 0; i <= 3; i++)
-        if (b == game->selblocks[i].ptr)
-            return 1;
-    return 0;
+/* Draws the latest snapshot if there is a new one and the terminal is ready for it */
+void render_frame(Game* game) {
+    unsigned long frame, stats;
+
+    /* Keep the throughput shown up to date */
+    if (now_usec() > output.stats_time) {
+        draw_game_stats(game->menuwin, &snaps[snap_front]);
+        output.stats_time = now_usec() + RATE_WINDOW * 2;
+    }
+    if (!(atomic_load(&snap_latest) & SNAP_FRESH) || !frame_ready())
+        return;
+    frame = snaps[snap_front].frame;
+    stats = snaps[snap_front].stats;
+    snap_front = atomic_exchange(&snap_latest, snap_front) & ~SNAP_FRESH;
+    /* Frames published while the terminal was busy are never drawn */
+    if (snaps[snap_front].frame > frame + 1)
+        METRIC_ADD(skipped, snaps[snap_front].frame - frame - 1);
+    draw_game_box(game->win, &snaps[snap_front]);
+    METRIC_ADD(frames, 1);
+    if (snaps[snap_front].stats != stats)
+        draw_game_stats(game->menuwin, &snaps[snap_front]);
 }
 
 /* Deletes current Tetromino */
@@ -357,6 +1120,7 @@ void delete_tetromino(Game* game) {
 /* Check if the tetromino can move certain blocks */
 int check_move(Game* game, int h, int v) {
 
+    TRACE_BEGIN(start);
     int chk = 1;
     int i, c, r;
     int color = *game->selblocks[0].ptr;
@@ -367,15 +1131,17 @@ int check_move(Game* game, int h, int v) {
     for (i = 0; i <= 3; i++) {
         c = game->selblocks[i].c;
         r = game->selblocks[i].r;
+        /* Check the bounds first so the block is never read outside the box */
         if (
-            (game->blocks[c + h][r + v] != COLOR_BLACK) ||
             (((c + h) > GAME_BLOCK_WIDTH) || ((r + v) > GAME_BLOCK_HEIGHT)) ||
-            ((c + h <= 0) || (r + v <= 0)))
+            ((c + h <= 0) || (r + v <= 0)) ||
+            (game->blocks[c + h][r + v] != COLOR_BLACK))
             chk = 0;
     }
     /* Restore blocks */
     for (i = 0; i <= 3; i++)
         *game->selblocks[i].ptr = color;
+    TRACE_END(start, "check_move", "sim");
     return chk;
 }
 
@@ -397,11 +1163,11 @@ int can_rotate(Game* game, int d) {
         nc = game->selblocks[i].center->c - (dr * d);
         nr = game->selblocks[i].center->r + (dc * d);
         if (
-            /* Check if there aren't any blocks on the new coordinates */
-            (game->blocks[nc][nr] != COLOR_BLACK) ||
             /* Check if new new coordinates are inside the box */
             ((nr < 1) || (nc < 1)) ||
-            ((nr > GAME_BLOCK_HEIGHT) || (nc > GAME_BLOCK_WIDTH)))
+            ((nr > GAME_BLOCK_HEIGHT) || (nc > GAME_BLOCK_WIDTH)) ||
+            /* Check if there aren't any blocks on the new coordinates */
+            (game->blocks[nc][nr] != COLOR_BLACK))
             r = 0;
     }
     /* Refill blocks */
@@ -440,24 +1206,29 @@ void rotate_tetromino(Game* game, int d) {
 
 /* Tries to force a tetromino do rotate by moving it */
 void try_rotate(Game* game, int d) {
+    TRACE_BEGIN(start);
+    kick_rotate(game, d);
+    TRACE_END(start, "try_rotate", "sim");
+}
 
-    if (game->ct.type == O)
-        return;
+/* Rotates the tetromino, moving it to the sides or down if it doesn't fit */
+void kick_rotate(Game* game, int d) {
 
-    /* All positions that are going to be tried */
-    int pos[4] = {-1, 1, -2, 2};
+    if (!rules.pieces[KIND(game->ct)].rotates)
+        return;
 
+    /* All positions that are going to be tried are in rules.kicks */
     if (can_rotate(game, d))
         rotate_tetromino(game, d);
     else {
-        for (int i = 0; i < 4; i++) {
-            if (check_move(game, pos[i], 0)) {
-                move_tetromino(game, pos[i], 0);
+        for (int i = 0; i < rules.nkicks; i++) {
+            if (check_move(game, rules.kicks[i], 0)) {
+                move_tetromino(game, rules.kicks[i], 0);
                 if (can_rotate(game, d)) {
                     rotate_tetromino(game, d);
                     return;
                 } else {
-                    move_tetromino(game, -pos[i], 0);
+                    move_tetromino(game, -rules.kicks[i], 0);
                 }
             }
         }
@@ -466,7 +1237,7 @@ void try_rotate(Game* game, int d) {
             move_tetromino(game, 0, 1);
             if (can_rotate(game, d))
                 rotate_tetromino(game, d);
-            else
+            else if (check_move(game, 0, 1))
                 move_tetromino(game, 0, 1);
         }
     }
@@ -474,6 +1245,7 @@ void try_rotate(Game* game, int d) {
 
 /* Places the tetromino in the current position (Deselects it) */
 void place_tetromino(Game* game) {
+    add_board_blocks(&game->board, game->selblocks);
     for (int i = 0; i <= 3; i++) {
         game->selblocks[i].ptr = NO_BLOCK;
         game->selblocks[i].c = 0;
@@ -505,6 +1277,761 @@ void move_tetromino(Game* game, int h, int v) {
     }
 }
 
+/* Reports an error in a rules file and exits */
+void rule_error(const char* path, int line, const char* msg) {
+    fprintf(stderr, "%s:%d: %s\n", path, line, msg);
+    exit(EXIT_FAILURE);
+}
+
+/* Reads a number of a rule */
+long rule_number(const char* path, int line, const char* word) {
+    char* end;
+    long v;
+
+    if (!word)
+        rule_error(path, line, "missing number");
+    v = strtol(word, &end, 10);
+    if (end == word || *end)
+        rule_error(path, line, "not a number");
+    return v;
+}
+
+/* Loads a rules file. Each line is a rule, the ones in the file replace the built-in ones:
+ *   piece NAME CENTER C,R C,R C,R C,R [fixed]
+ *   gravity MS...
+ *   points 1LINE 2LINES 3LINES 4LINES
+ *   kicks COLUMNS... */
+void load_rules(const char* path) {
+    FILE* f = fopen(path, "r");
+    char buf[256];
+    int line = 0, pieces = 0;
+    const char* sep = " \t\r\n";
+
+    if (!f) {
+        perror(path);
+        exit(EXIT_FAILURE);
+    }
+    while (fgets(buf, sizeof(buf), f)) {
+        char* word = strtok(buf, sep);
+        line++;
+        if (!word || *word == '#')
+            continue;
+        if (!strcmp(word, "piece")) {
+            Piece* pc;
+            if (!pieces++)
+                rules.npieces = 0;
+            if (rules.npieces == MAX_PIECES)
+                rule_error(path, line, "too many pieces");
+            pc = &rules.pieces[rules.npieces];
+            word = strtok(NULL, sep);
+            if (!word || strlen(word) != 1 || !isalnum((unsigned char) *word))
+                rule_error(path, line, "the name must be a letter or a digit");
+            for (int i = 0; i < rules.npieces; i++)
+                if (rules.pieces[i].name == *word)
+                    rule_error(path, line, "there is another piece with this name");
+            pc->name = *word;
+            pc->cpos = rule_number(path, line, strtok(NULL, sep));
+            if (pc->cpos < 0 || pc->cpos > 3)
+                rule_error(path, line, "the center must be a block from 0 to 3");
+            for (int i = 0; i < 4; i++) {
+                char end;
+                word = strtok(NULL, sep);
+                if (!word || sscanf(word, "%d,%d%c", &pc->pos[i][0], &pc->pos[i][1], &end) != 2)
+                    rule_error(path, line, "expected four blocks as COLUMN,ROW");
+                /* Pieces are shown in a 4x4 box and spawn at the top */
+                if (pc->pos[i][0] < -1 || pc->pos[i][0] > 2 || pc->pos[i][1] < 1 || pc->pos[i][1] > 4)
+                    rule_error(path, line, "blocks go from -1,1 to 2,4");
+                for (int j = 0; j < i; j++)
+                    if (pc->pos[i][0] == pc->pos[j][0] && pc->pos[i][1] == pc->pos[j][1])
+                        rule_error(path, line, "two blocks are in the same place");
+            }
+            word = strtok(NULL, sep);
+            pc->rotates = !word || strcmp(word, "fixed");
+            if (word && pc->rotates)
+                rule_error(path, line, "expected fixed after the blocks");
+            rules.npieces++;
+        } else if (!strcmp(word, "gravity")) {
+            rules.nlevels = 0;
+            while ((word = strtok(NULL, sep))) {
+                if (rules.nlevels == MAX_LEVELS)
+                    rule_error(path, line, "too many levels");
+                rules.gravity[rules.nlevels] = rule_number(path, line, word) * 1000;
+                if (rules.gravity[rules.nlevels++] <= 0)
+                    rule_error(path, line, "the gravity must be positive");
+            }
+            if (!rules.nlevels)
+                rule_error(path, line, "missing number");
+        } else if (!strcmp(word, "points")) {
+            for (int i = 1; i <= 4; i++)
+                if ((rules.points[i] = rule_number(path, line, strtok(NULL, sep))) < 0)
+                    rule_error(path, line, "points can't be negative");
+            if (strtok(NULL, sep))
+                rule_error(path, line, "expected the points for 1 to 4 lines");
+        } else if (!strcmp(word, "kicks")) {
+            rules.nkicks = 0;
+            while ((word = strtok(NULL, sep))) {
+                if (rules.nkicks == MAX_KICKS)
+                    rule_error(path, line, "too many kicks");
+                rules.kicks[rules.nkicks] = rule_number(path, line, word);
+                if (abs(rules.kicks[rules.nkicks++]) >= GAME_BLOCK_WIDTH)
+                    rule_error(path, line, "kicks must be smaller than the board");
+            }
+        } else {
+            rule_error(path, line, "unknown rule");
+        }
+    }
+    fclose(f);
+}
+
+/* Loads a starting board for perft. Each line is a row, the last one at the
+ * bottom, with . for an empty cell and x for a block. Lines starting with #
+ * are comments */
+void load_board(const char* path, uint16_t* rows) {
+    FILE* f = fopen(path, "r");
+    char buf[256];
+    uint16_t loaded[GAME_BLOCK_HEIGHT];
+    int line = 0, n = 0;
+
+    if (!f) {
+        perror(path);
+        exit(EXIT_FAILURE);
+    }
+    while (fgets(buf, sizeof(buf), f)) {
+        size_t len = strcspn(buf, "\r\n");
+        line++;
+        if (!len || *buf == '#')
+            continue;
+        if (n == GAME_BLOCK_HEIGHT)
+            rule_error(path, line, "too many rows");
+        if (len != GAME_BLOCK_WIDTH || strspn(buf, ".x") < len)
+            rule_error(path, line, "expected a row of 10 cells, . or x");
+        loaded[n] = 0;
+        for (int c = 0; c < GAME_BLOCK_WIDTH; c++)
+            loaded[n] |= (buf[c] == 'x') << c;
+        if (loaded[n++] == FULL_ROW)
+            rule_error(path, line, "full rows are deleted, they can't be on the board");
+    }
+    fclose(f);
+    memset(rows, 0, GAME_BLOCK_HEIGHT * sizeof(uint16_t));
+    memcpy(rows + GAME_BLOCK_HEIGHT - n, loaded, n * sizeof(uint16_t));
+}
+
+/* Builds the engine's lookup tables from the pieces of the rules. Rotations
+ * follow rotate_tetromino: each block turns around the center block */
+void init_kinds() {
+    for (int k = 0; k < rules.npieces; k++) {
+        Kind* kd = &kinds[k];
+        Tetromino t = {k + 1, 0};
+        int cen = T_CEN(t);
+
+        rules.names[k] = rules.pieces[k].name;
+        kd->rotates = rules.pieces[k].rotates;
+        kd->spawnc = T_COL(t, cen);
+        kd->spawnr = T_ROW(t, cen);
+        for (int i = 0; i < 4; i++) {
+            kd->rot[0].cells[i][0] = T_COL(t, i) - kd->spawnc;
+            kd->rot[0].cells[i][1] = T_ROW(t, i) - kd->spawnr;
+        }
+        for (int o = 0; o < 4; o++) {
+            Orientation* or = &kd->rot[o];
+            int maxx = -4, maxy = -4;
+            if (o > 0)
+                for (int i = 0; i < 4; i++) {
+                    or->cells[i][0] = kd->rot[o - 1].cells[i][1];
+                    or->cells[i][1] = -kd->rot[o - 1].cells[i][0];
+                }
+            or->minx = or->miny = 4;
+            for (int i = 0; i < 4; i++) {
+                or->minx = or->cells[i][0] < or->minx ? or->cells[i][0] : or->minx;
+                or->miny = or->cells[i][1] < or->miny ? or->cells[i][1] : or->miny;
+                maxx = or->cells[i][0] > maxx ? or->cells[i][0] : maxx;
+                maxy = or->cells[i][1] > maxy ? or->cells[i][1] : maxy;
+            }
+            or->w = maxx - or->minx + 1;
+            or->h = maxy - or->miny + 1;
+            memset(or->rows, 0, sizeof(or->rows));
+            for (int i = 0; i < 4; i++)
+                or->rows[or->cells[i][1] - or->miny] |= 1 << (or->cells[i][0] - or->minx);
+        }
+    }
+}
+
+/* Checks if a tetromino fits with its center at x, y */
+int piece_fits(const uint16_t* rows, const Orientation* o, int x, int y) {
+    int x0 = x + o->minx, y0 = y + o->miny;
+    if (x0 < 0 || y0 < 0 || x0 + o->w > GAME_BLOCK_WIDTH || y0 + o->h > GAME_BLOCK_HEIGHT)
+        return 0;
+    for (int i = 0; i < o->h; i++)
+        if (rows[y0 + i] & (o->rows[i] << x0))
+            return 0;
+    return 1;
+}
+
+/* Places a tetromino on a board and deletes the full rows. Returns the number of deleted rows */
+int lock_piece(uint16_t* rows, const Orientation* o, int x, int y) {
+    int x0 = x + o->minx, y0 = y + o->miny;
+    int dl = 0;
+
+    for (int i = 0; i < o->h; i++)
+        rows[y0 + i] |= o->rows[i] << x0;
+    /* Only the rows of the tetromino can be full. Move the rest down over them */
+    for (int src = y0 + o->h - 1, dst = src; dst >= 0; src--, dst--) {
+        while (src >= y0 && rows[src] == FULL_ROW) {
+            src--;
+            dl++;
+        }
+        if (!dl && src < y0)
+            break;
+        rows[dst] = src >= 0 ? rows[src] : 0;
+    }
+    return dl;
+}
+
+/* Finds where a tetromino spawns, trying the columns like try_spawn. Returns 0 if it can't */
+int spawn_piece(const uint16_t* rows, int kind, int* x, int* y) {
+    for (int i = 0; i < 10; i++) {
+        *x = try_pos[i] + kinds[kind].spawnc - 1;
+        *y = kinds[kind].spawnr - 1;
+        if (piece_fits(rows, &kinds[kind].rot[0], *x, *y))
+            return 1;
+    }
+    return 0;
+}
+
+/* Moves or rotates a tetromino like the game does. Drops aren't handled here */
+void move_piece(const uint16_t* rows, int kind, int* rot, int* x, int* y, Action a) {
+    const Kind* kd = &kinds[kind];
+    int nr;
+
+    switch (a) {
+    case ACT_LEFT:
+    case ACT_RIGHT:
+        if (piece_fits(rows, &kd->rot[*rot], *x + (a == ACT_LEFT ? -1 : 1), *y))
+            *x += a == ACT_LEFT ? -1 : 1;
+        break;
+    case ACT_ROTATE_LEFT:
+    case ACT_ROTATE_RIGHT:
+        if (!kd->rotates)
+            break;
+        nr = (*rot + (a == ACT_ROTATE_LEFT ? 3 : 1)) % 4;
+        /* Same kicks as kick_rotate: sideways, then one row down */
+        if (piece_fits(rows, &kd->rot[nr], *x, *y)) {
+            *rot = nr;
+            break;
+        }
+        for (int i = 0; i < rules.nkicks; i++)
+            if (piece_fits(rows, &kd->rot[*rot], *x + rules.kicks[i], *y) &&
+                piece_fits(rows, &kd->rot[nr], *x + rules.kicks[i], *y)) {
+                *x += rules.kicks[i];
+                *rot = nr;
+                return;
+            }
+        if (piece_fits(rows, &kd->rot[*rot], *x, *y + 1)) {
+            *y += 1;
+            if (piece_fits(rows, &kd->rot[nr], *x, *y))
+                *rot = nr;
+            else if (piece_fits(rows, &kd->rot[*rot], *x, *y + 1))
+                *y += 1;
+        }
+        break;
+    default:
+        break;
+    }
+}
+
+/* Next tetromino kind, drawn like gentetromino */
+int next_kind(unsigned int* seed) {
+    return next_random(seed) % rules.npieces;
+}
+
+/* Allocates n games. Nothing is allocated after this */
+Batch* batch_create(int n, unsigned int seed) {
+    Batch* b = calloc(1, sizeof(Batch));
+    if (!b)
+        return NULL;
+    b->n = n;
+    b->rows = calloc((size_t) n * GAME_BLOCK_HEIGHT, sizeof(uint16_t));
+    b->kind = calloc(n, 1);
+    b->rot = calloc(n, 1);
+    b->next = calloc(n, 1);
+    b->color = calloc(n, 1);
+    b->x = calloc(n, 1);
+    b->y = calloc(n, 1);
+    b->seed = calloc(n, sizeof(unsigned int));
+    b->points = calloc(n, sizeof(unsigned int));
+    b->lines = calloc(n, sizeof(int));
+    b->cleared = calloc(n, sizeof(int));
+    b->done = calloc(n, 1);
+    if (!b->rows || !b->kind || !b->rot || !b->next || !b->color || !b->x || !b->y ||
+        !b->seed || !b->points || !b->lines || !b->cleared || !b->done) {
+        batch_free(b);
+        return NULL;
+    }
+    for (int g = 0; g < n; g++) {
+        b->seed[g] = split_seed(seed, g);
+        batch_reset(b, g);
+    }
+    return b;
+}
+
+void batch_free(Batch* b) {
+    free(b->rows);
+    free(b->kind);
+    free(b->rot);
+    free(b->next);
+    free(b->color);
+    free(b->x);
+    free(b->y);
+    free(b->seed);
+    free(b->points);
+    free(b->lines);
+    free(b->cleared);
+    free(b->done);
+    free(b);
+}
+
+/* Starts game g again with an empty board */
+void batch_reset(Batch* b, int g) {
+    uint16_t* rows = &b->rows[(size_t) g * GAME_BLOCK_HEIGHT];
+    int x, y;
+
+    memset(rows, 0, GAME_BLOCK_HEIGHT * sizeof(uint16_t));
+    b->kind[g] = next_kind(&b->seed[g]);
+    b->next[g] = next_kind(&b->seed[g]);
+    b->color[g] = 1;
+    b->rot[g] = 0;
+    spawn_piece(rows, b->kind[g], &x, &y);
+    b->x[g] = x;
+    b->y[g] = y;
+    b->points[g] = 0;
+    b->lines[g] = 0;
+    b->done[g] = 0;
+}
+
+/* Advances every game by one action followed by one row of gravity, and
+ * writes OBS_SIZE values per game to obs. Games that ended start again */
+void batch_step(Batch* b, const unsigned char* actions, uint16_t* obs) {
+    int n = b->n;
+
+    for (int g = 0; g < n; g++) {
+        uint16_t* rows = &b->rows[(size_t) g * GAME_BLOCK_HEIGHT];
+        int rot, x, y;
+        const Orientation* o;
+
+        if (b->done[g])
+            batch_reset(b, g);
+        rot = b->rot[g];
+        x = b->x[g];
+        y = b->y[g];
+        b->cleared[g] = 0;
+        move_piece(rows, b->kind[g], &rot, &x, &y, actions[g]);
+        o = &kinds[b->kind[g]].rot[rot];
+        if (actions[g] == ACT_HARD_DROP || actions[g] == ACT_SOFT_DROP)
+            while (piece_fits(rows, o, x, y + 1) && (y++, actions[g] == ACT_HARD_DROP))
+                ;
+        /* Gravity, lock the tetromino if it can't go down */
+        if (actions[g] != ACT_HARD_DROP && piece_fits(rows, o, x, y + 1)) {
+            y++;
+        } else {
+            int dl = lock_piece(rows, o, x, y);
+            if (dl) {
+                b->points[g] += rules.points[dl] * (b->lines[g] / 10 + 1);
+                b->lines[g] += dl;
+                b->cleared[g] = dl;
+            }
+            b->kind[g] = b->next[g];
+            b->next[g] = next_kind(&b->seed[g]);
+            b->color[g] = NCOLOR(b->color[g]);
+            rot = 0;
+            b->done[g] = !spawn_piece(rows, b->kind[g], &x, &y);
+        }
+        b->rot[g] = rot;
+        b->x[g] = x;
+        b->y[g] = y;
+    }
+    b->steps += n;
+    if (!obs)
+        return;
+    for (int g = 0; g < n; g++) {
+        uint16_t* ob = &obs[g * OBS_SIZE + GAME_BLOCK_HEIGHT];
+
+        for (int r = 0; r < GAME_BLOCK_HEIGHT; r++)
+            obs[g * OBS_SIZE + r] = b->rows[(size_t) g * GAME_BLOCK_HEIGHT + r];
+        ob[0] = b->kind[g];
+        ob[1] = b->rot[g];
+        ob[2] = b->x[g];
+        ob[3] = b->y[g];
+        ob[4] = b->next[g];
+        ob[5] = b->cleared[g];
+        ob[6] = b->done[g];
+    }
+}
+
+/* Steps n games with random actions for a couple of seconds and prints the speed */
+void bench_batch(int n) {
+    Batch* b = batch_create(n, time(0) | 1);
+    unsigned char* actions = malloc(n);
+    uint16_t* obs = malloc((size_t) n * OBS_SIZE * sizeof(uint16_t));
+    unsigned int seed = 2463534242u;
+    unsigned long games = 0;
+    long start, elapsed;
+
+    if (!b || !actions || !obs) {
+        fprintf(stderr, "Not enough memory for %d games\n", n);
+        exit(EXIT_FAILURE);
+    }
+    start = now_usec();
+    do {
+        for (int g = 0; g < n; g++)
+            actions[g] = next_random(&seed) % ACTIONS;
+        batch_step(b, actions, obs);
+        for (int g = 0; g < n; g++)
+            games += obs[g * OBS_SIZE + GAME_BLOCK_HEIGHT + 6];
+    } while ((elapsed = now_usec() - start) < 2000000);
+    printf("%d games, %lu steps, %lu games over in %.2f s: %.0f steps/s\n",
+           n, b->steps, games, elapsed / 1e6, b->steps * 1e6 / elapsed);
+    free(obs);
+    free(actions);
+    batch_free(b);
+}
+
+/* Empties the board features */
+void clear_board_stats(BoardStats* bs) {
+    memset(bs, 0, sizeof(*bs));
+    /* An empty row has a transition next to each wall */
+    bs->transitions = GAME_BLOCK_HEIGHT * 2;
+}
+
+/* Changes between empty and full cells along row r, the walls are full */
+int row_transitions(const BoardStats* bs, int r) {
+    uint32_t row = 1u | 1u << (GAME_BLOCK_WIDTH + 1);
+
+    for (int c = 1; c <= GAME_BLOCK_WIDTH; c++)
+        row |= (bs->cols[c] >> r & 1) << c;
+    return __builtin_popcount((row ^ row >> 1) & ((1u << (GAME_BLOCK_WIDTH + 1)) - 1));
+}
+
+/* Updates the height and holes of column c from its blocks */
+void update_column_stats(BoardStats* bs, int c) {
+    uint32_t col = bs->cols[c];
+
+    /* The lowest bit is the top block */
+    bs->heights[c] = col ? GAME_BLOCK_HEIGHT + 1 - __builtin_ctz(col) : 0;
+    bs->holes -= bs->colholes[c];
+    bs->colholes[c] = bs->heights[c] - __builtin_popcount(col);
+    bs->holes += bs->colholes[c];
+}
+
+/* Updates the features that depend on the heights of all the columns */
+void update_surface_stats(BoardStats* bs) {
+    bs->height = bs->bumpiness = bs->wells = 0;
+    for (int c = 1; c <= GAME_BLOCK_WIDTH; c++) {
+        int left = c > 1 ? bs->heights[c - 1] : GAME_BLOCK_HEIGHT;
+        int right = c < GAME_BLOCK_WIDTH ? bs->heights[c + 1] : GAME_BLOCK_HEIGHT;
+        int lower = (left < right ? left : right) - bs->heights[c];
+
+        if (bs->heights[c] > bs->height)
+            bs->height = bs->heights[c];
+        if (c > 1)
+            bs->bumpiness += abs(bs->heights[c] - left);
+        if (lower > 0)
+            bs->wells += lower;
+    }
+}
+
+/* Adds the four blocks of a placed tetromino */
+void add_board_blocks(BoardStats* bs, const Tblock* blocks) {
+    for (int i = 0; i <= 3; i++) {
+        int c = blocks[i].c, r = blocks[i].r, seen = 0;
+
+        /* Count each row once, even with more blocks in it */
+        for (int j = 0; j < i; j++)
+            seen |= blocks[j].r == r;
+        if (!seen)
+            bs->transitions -= row_transitions(bs, r);
+        for (int j = i; j <= 3; j++)
+            if (blocks[j].r == r)
+                bs->cols[blocks[j].c] |= 1u << r;
+        if (!seen)
+            bs->transitions += row_transitions(bs, r);
+        update_column_stats(bs, c);
+    }
+    update_surface_stats(bs);
+}
+
+/* Deletes full row r and moves the rows above it down. Call
+ * update_surface_stats() once all the rows are deleted */
+void delete_board_row(BoardStats* bs, int r) {
+    uint32_t above = (1u << r) - 1;
+
+    for (int c = 1; c <= GAME_BLOCK_WIDTH; c++) {
+        bs->cols[c] = (bs->cols[c] & ~(above | 1u << r)) | (bs->cols[c] & above) << 1;
+        update_column_stats(bs, c);
+    }
+    /* A full row has no transitions and an empty one comes in at the top */
+    bs->transitions += 2;
+}
+
+/* Features of the placed blocks of a game, for overlays, bots and stats */
+const BoardStats* board_stats(const Game* game) {
+    return &game->board;
+}
+
+/* Finds every board left by placing a tetromino of a kind, moving it with the
+ * game's moves, rotations and gravity from where it spawns. Returns how many
+ * were written to boards, 0 if it can't spawn. The same board can repeat */
+int placements(const uint16_t* rows, int kind, uint16_t (*boards)[GAME_BLOCK_HEIGHT]) {
+    unsigned char seen[4][GAME_BLOCK_HEIGHT][GAME_BLOCK_WIDTH] = {{{0}}};
+    short queue[MAX_PLACEMENTS]; /* rot, row and column packed together */
+    int head = 0, tail = 0, n = 0;
+    int x, y;
+
+    if (!spawn_piece(rows, kind, &x, &y))
+        return 0;
+    seen[0][y][x] = 1;
+    queue[tail++] = y * GAME_BLOCK_WIDTH + x;
+    while (head < tail) {
+        int rot = queue[head] / (GAME_BLOCK_HEIGHT * GAME_BLOCK_WIDTH);
+        int pos = queue[head++] % (GAME_BLOCK_HEIGHT * GAME_BLOCK_WIDTH);
+        const Orientation* o = &kinds[kind].rot[rot];
+        y = pos / GAME_BLOCK_WIDTH;
+        x = pos % GAME_BLOCK_WIDTH;
+        for (Action a = ACT_LEFT; a <= ACT_SOFT_DROP; a++) {
+            int nr = rot, nx = x, ny = y;
+            if (a == ACT_SOFT_DROP) {
+                if (!piece_fits(rows, o, x, y + 1)) {
+                    /* It can't go down, so it locks here */
+                    memcpy(boards[n], rows, sizeof(boards[n]));
+                    lock_piece(boards[n++], o, x, y);
+                    continue;
+                }
+                ny++;
+            } else {
+                move_piece(rows, kind, &nr, &nx, &ny, a);
+            }
+            if (!seen[nr][ny][nx]) {
+                seen[nr][ny][nx] = 1;
+                queue[tail++] = (nr * GAME_BLOCK_HEIGHT + ny) * GAME_BLOCK_WIDTH + nx;
+            }
+        }
+    }
+    return n;
+}
+
+/* Hash of a board at a depth of the perft tree, never 0 */
+uint64_t hash_board(const uint16_t* rows, int depth) {
+    uint64_t h = depth + 1;
+    for (int r = 0; r < GAME_BLOCK_HEIGHT; r++) {
+        h = (h ^ rows[r]) * 0x9e3779b97f4a7c15ULL;
+        h ^= h >> 29;
+    }
+    return h ? h : 1;
+}
+
+/* Adds a board hash to the perft table. Returns 1 if it wasn't there. Any
+ * number of threads can insert at once: a slot is claimed with a CAS */
+int perft_insert(uint64_t key) {
+    uint64_t i = key & perft.mask;
+
+    for (int p = 0; p < PERFT_PROBES; p++, i = (i + 1) & perft.mask) {
+        uint64_t cur = atomic_load_explicit(&perft.table[i], memory_order_relaxed);
+        if (cur == key)
+            return 0;
+        if (!cur) {
+            if (atomic_compare_exchange_strong(&perft.table[i], &cur, key))
+                return 1;
+            if (cur == key)
+                return 0;
+        }
+    }
+    /* Not searched, the run fails */
+    atomic_store(&perft.full, 1);
+    return 0;
+}
+
+/* Counts the new boards under a board reached after depth tetrominos */
+void perft_node(PerftThread* t, const uint16_t* rows, int depth) {
+    uint16_t boards[MAX_PLACEMENTS][GAME_BLOCK_HEIGHT];
+    int n;
+
+    if (depth >= perft.depth)
+        return;
+    n = placements(rows, strchr(rules.names, perft.seq[depth]) - rules.names, boards);
+    t->placements += n;
+    for (int i = 0; i < n; i++)
+        if (perft_insert(hash_board(boards[i], depth + 1))) {
+            t->nodes[depth + 1]++;
+            perft_node(t, boards[i], depth + 1);
+        }
+}
+
+/* Takes the boards after the first tetromino one at a time and searches them */
+void* perft_worker(void* arg) {
+    PerftThread* t = arg;
+    int i;
+
+    while ((i = atomic_fetch_add(&perft.nextroot, 1)) < perft.nroots)
+        perft_node(t, perft.roots[i], 1);
+    return NULL;
+}
+
+/* Counts the distinct boards reached by placing the tetrominos of seq, one
+ * per depth, from board, and prints the counts and the speed */
+void run_perft(const char* seq, const uint16_t* board) {
+    static PerftThread threads[PERFT_MAX_THREADS];
+    double expected = 0, boards = 1; /* Boards the table needs room for */
+    int bits = 16;
+    unsigned long nodes[PERFT_MAX_DEPTH + 1] = {0}, total = 0, generated;
+    long nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+    long start, elapsed;
+    int n;
+
+    if (nthreads < 1)
+        nthreads = 1;
+    if (nthreads > PERFT_MAX_THREADS)
+        nthreads = PERFT_MAX_THREADS;
+    perft.seq = seq;
+    perft.depth = strlen(seq);
+    perft.roots = malloc(MAX_PLACEMENTS * sizeof(*perft.roots));
+    if (!perft.roots) {
+        fprintf(stderr, "Not enough memory for perft\n");
+        exit(EXIT_FAILURE);
+    }
+    /* Expect each tetromino to multiply the boards by its placements on the
+     * starting board, and keep the table at most half full */
+    for (int d = 0; d < perft.depth; d++) {
+        boards *= placements(board, strchr(rules.names, seq[d]) - rules.names, perft.roots);
+        expected += boards;
+    }
+    while (bits < PERFT_MAX_TABLE_BITS && (double) (1ULL << bits) < expected * 2)
+        bits++;
+    if ((double) (1ULL << bits) < expected * 2) {
+        fprintf(stderr, "perft %s: about %.0f boards, more than the table can hold\n", seq, expected);
+        exit(EXIT_FAILURE);
+    }
+    perft.mask = (1ULL << bits) - 1;
+    perft.table = calloc(perft.mask + 1, sizeof(uint64_t));
+    if (!perft.table) {
+        fprintf(stderr, "Not enough memory for perft\n");
+        exit(EXIT_FAILURE);
+    }
+    start = now_usec();
+    /* Split the tree after the first tetromino, each thread takes the next root */
+    n = placements(board, strchr(rules.names, seq[0]) - rules.names, perft.roots);
+    generated = n;
+    for (int i = 0; i < n; i++)
+        if (perft_insert(hash_board(perft.roots[i], 1)))
+            memmove(perft.roots[perft.nroots++], perft.roots[i], sizeof(perft.roots[i]));
+    nodes[1] = perft.nroots;
+    for (int i = 0; i < nthreads; i++)
+        if (pthread_create(&threads[i].id, NULL, perft_worker, &threads[i])) {
+            nthreads = i;
+            break;
+        }
+    /* Search here too if no thread could start */
+    if (!nthreads)
+        perft_worker(&threads[nthreads++]);
+    else
+        for (int i = 0; i < nthreads; i++)
+            pthread_join(threads[i].id, NULL);
+    elapsed = now_usec() - start;
+    if (atomic_load(&perft.full)) {
+        fprintf(stderr, "perft %s: the table is full, the boards can't be counted\n", seq);
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < nthreads; i++) {
+        for (int d = 2; d <= perft.depth; d++)
+            nodes[d] += threads[i].nodes[d];
+        generated += threads[i].placements;
+    }
+    printf("perft %s, %ld threads\n", seq, nthreads);
+    for (int d = 1; d <= perft.depth; d++) {
+        printf("depth %2d: %lu\n", d, nodes[d]);
+        total += nodes[d];
+    }
+    printf("%lu nodes, %lu placements in %.3f s: %.0f nodes/s\n", total, generated,
+           elapsed / 1e6, total * 1e6 / (elapsed ? elapsed : 1));
+    free(perft.roots);
+    free((void*) perft.table);
+}
+
+/* Finds the fewest inputs that bring the current tetromino to every position
+ * with the engine's moves, one cost at a time. Going down is free, since
+ * gravity does it, and '<' followed by an arrow counts as two inputs */
+void plan_finesse(Game* game) {
+    TRACE_BEGIN(start);
+    uint16_t rows[GAME_BLOCK_HEIGHT] = {0};
+    const Kind* kd = &kinds[KIND(game->ct)];
+    int kind = KIND(game->ct);
+    int last = 0;
+
+/* Lowers the cost of a position */
+#define REACH(R, X, Y, C)                          \
+    if (game->reach[R][Y][X] > (C)) {              \
+        game->reach[R][Y][X] = (C);                \
+        last = (C) > last ? (C) : last;            \
+    }
+    /* The board without the current tetromino */
+    for (int c = 1; c <= GAME_BLOCK_WIDTH; c++)
+        for (int r = 1; r <= GAME_BLOCK_HEIGHT; r++)
+            if (game->blocks[c][r])
+                rows[r - 1] |= 1 << (c - 1);
+    for (int i = 0; i <= 3; i++)
+        rows[game->selblocks[i].r - 1] &= ~(1 << (game->selblocks[i].c - 1));
+    memset(game->reach, UNREACHED, sizeof(game->reach));
+    game->reach[0][game->selblocks[0].center->r - 1][game->selblocks[0].center->c - 1] = 0;
+    game->presses = 0;
+    /* Rows go downwards, so the free moves down are seen in the same pass */
+    for (int cost = 0; cost <= last; cost++)
+        for (int y = 0; y < GAME_BLOCK_HEIGHT; y++)
+            for (int rot = 0; rot < 4; rot++)
+                for (int x = 0; x < GAME_BLOCK_WIDTH; x++) {
+                    if (game->reach[rot][y][x] != cost)
+                        continue;
+                    if (piece_fits(rows, &kd->rot[rot], x, y + 1))
+                        REACH(rot, x, y + 1, cost);
+                    for (Action a = ACT_LEFT; a <= ACT_ROTATE_RIGHT; a++) {
+                        int nr = rot, nx = x, ny = y;
+                        move_piece(rows, kind, &nr, &nx, &ny, a);
+                        REACH(nr, nx, ny, cost + 1);
+                    }
+                    for (int d = -1; d <= 1; d += 2) {
+                        int nx = x;
+                        while (piece_fits(rows, &kd->rot[rot], nx + d, y))
+                            nx += d;
+                        REACH(rot, nx, y, cost + 2);
+                    }
+                }
+#undef REACH
+    TRACE_END(start, "plan_finesse", "sim");
+}
+
+/* Compares the inputs pressed for the tetromino that is being placed with
+ * the fewest inputs that reach the same blocks */
+void score_finesse(Game* game) {
+    uint16_t placed[GAME_BLOCK_HEIGHT] = {0};
+    const Kind* kd = &kinds[KIND(game->ct)];
+    int fewest = UNREACHED;
+
+    for (int i = 0; i <= 3; i++)
+        placed[game->selblocks[i].r - 1] |= 1 << (game->selblocks[i].c - 1);
+    for (int rot = 0; rot < 4; rot++)
+        for (int y = 0; y < GAME_BLOCK_HEIGHT; y++)
+            for (int x = 0; x < GAME_BLOCK_WIDTH; x++) {
+                const Orientation* o = &kd->rot[rot];
+                int x0 = x + o->minx, y0 = y + o->miny, same = 1;
+                if (game->reach[rot][y][x] >= fewest)
+                    continue;
+                /* Both have four blocks, so the same blocks if all of these are placed */
+                for (int i = 0; i < o->h && same; i++)
+                    same = (placed[y0 + i] & (o->rows[i] << x0)) == o->rows[i] << x0;
+                if (same)
+                    fewest = game->reach[rot][y][x];
+            }
+    game->excess = fewest != UNREACHED && game->presses > fewest ? game->presses - fewest : 0;
+    game->faults += game->excess;
+}
+
 /* Initializes the color pairs that are going to be used */
 void init_color_pairs() {
     int colors[] = {COLOR_BLACK, COLOR_RED, COLOR_CYAN, COLOR_YELLOW, COLOR_GREEN, COLOR_WHITE};
@@ -517,6 +2044,31 @@ void init_color_pairs() {
         init_pair(10 + i, colors[i], -1);
     }
     init_pair(10, COLOR_BLACK, -1);
+    /* Pairs for half blocks, foreground is the upper block */
+    for (int f = 1; f < 6; f++)
+        for (int b = 0; b < 6; b++)
+            init_pair(HALF_PAIR(f, b), colors[f], b ? colors[b] : -1);
+}
+
+/* Draws two vertically stacked blocks with colors top and bottom as one
+ * character cell one or two columns wide */
+void draw_half_blocks(WINDOW* win, int y, int x, int top, int bottom, int width) {
+    const char* ch = width == 2 ? "\u2580\u2580" : "\u2580"; /* Upper half block */
+    int pair;
+
+    if (top == bottom) {
+        ch = width == 2 ? "  " : " ";
+        pair = top;
+    } else if (!top) {
+        ch = width == 2 ? "\u2584\u2584" : "\u2584"; /* Lower half block */
+        pair = HALF_PAIR(bottom, 0);
+    } else {
+        pair = HALF_PAIR(top, bottom);
+    }
+    wattrset(win, COLOR_PAIR(pair));
+    mvwaddstr(win, y, x, ch);
+    wattrset(win, A_NORMAL);
+    METRIC_ADD(curses_calls, 3);
 }
 
 /* Draws a tetromino on a window in certain coordinates */
@@ -533,12 +2085,19 @@ void draw_tetromino(WINDOW* win, Tetromino t, int y, int x) {
             r = T_ROW(t, i) - 1;
             blocks[c][r] = t.color;
         }
+    if (compact) {
+        for (int c = 0; c < 4; c++)
+            for (int r = 0; r < 4; r += 2)
+                draw_half_blocks(win, y + r / 2, x + c * 2, blocks[c][r], blocks[c][r + 1], 2);
+        return;
+    }
     for (int c = 0; c < 4; c++)
         for (int r = 0; r < 4; r++)
             for (int i = 0; i <= 1; i++)
                 for (int a = 0; a <= 3; a++)
                     mvwaddch(win, (r * 2 - i) + y, (c * 4 - a) + x,
                              BOX_CHAR | COLOR_PAIR(blocks[c][r]));
+    METRIC_ADD(curses_calls, 4 * 4 * 2 * 4);
 }
 
 /* Deletes all characters on the window */
@@ -549,21 +2108,57 @@ void clearwin(WINDOW* win) {
 }
 
 /* Displays the stats in the game's menu */
-void draw_game_stats(Game* game) {
+void draw_game_stats(WINDOW* menuwin, const Snapshot* snap) {
+    TRACE_BEGIN(start);
     /* Show points */
     char buf[30];
-    sprintf(buf, "Points: %i", game->points);
-    mvwaddstr(game->menuwin, 2, 5, buf);
+    sprintf(buf, "Points: %i", snap->points);
+    mvwaddstr(menuwin, 2, STATS_COL, buf);
     /* Show level */
-    sprintf(buf, "Level: %i", game->level);
-    mvwaddstr(game->menuwin, 4, 5, buf);
-    /* Show tetromino on hold */
-    mvwaddstr(game->menuwin, MAXY(game->menuwin) - 12, 5, "Next:");
-    draw_tetromino(game->menuwin, game->nt, MAXY(game->menuwin) - 8, 9);
-    /* Show next tetromino */
-    mvwaddstr(game->menuwin, MAXY(game->menuwin) - 24, 5, "Holding:");
-    draw_tetromino(game->menuwin, game->oh, MAXY(game->menuwin) - 20, 9);
-    wrefresh(game->menuwin);
+    sprintf(buf, "Level: %i", snap->level);
+    mvwaddstr(menuwin, 4, STATS_COL, buf);
+    /* Show the output throughput */
+    sample_output();
+    sprintf(buf, "Out: %.1f KB/s", output.rate / 1024);
+    draw_stats_line(menuwin, compact ? 10 : 6, buf);
+    sprintf(buf, "Frame: %ld B %.0f fps", output.frame_bytes, output.fps);
+    draw_stats_line(menuwin, compact ? 11 : 7, buf);
+    /* Show the inputs over the fewest needed, for the last tetromino and in total */
+    if (finesse) {
+        sprintf(buf, "Finesse: +%i (%i)", snap->excess, snap->faults);
+        draw_stats_line(menuwin, compact ? 12 : 9, buf);
+    }
+    /* Show the features of the board */
+    sprintf(buf, "Height %i Holes %i", snap->board.height, snap->board.holes);
+    draw_stats_line(menuwin, compact ? 13 : 10, buf);
+    sprintf(buf, "Bump %i Wells %i", snap->board.bumpiness, snap->board.wells);
+    draw_stats_line(menuwin, compact ? 14 : 11, buf);
+    if (compact) {
+        /* Show the tetromino on hold and the next one side by side */
+        mvwaddstr(menuwin, 6, 2, "Holding:");
+        draw_tetromino(menuwin, snap->oh, 7, 2);
+        mvwaddstr(menuwin, 6, 12, "Next:");
+        draw_tetromino(menuwin, snap->nt, 7, 12);
+    } else {
+        /* Show next tetromino */
+        mvwaddstr(menuwin, MAXY(menuwin) - 12, 5, "Next:");
+        draw_tetromino(menuwin, snap->nt, MAXY(menuwin) - 8, 9);
+        /* Show tetromino on hold */
+        mvwaddstr(menuwin, MAXY(menuwin) - 24, 5, "Holding:");
+        draw_tetromino(menuwin, snap->oh, MAXY(menuwin) - 20, 9);
+    }
+    TRACE_END(start, "draw_game_stats", "render");
+    start = trace_path ? now_usec() : 0;
+    wrefresh(menuwin);
+    TRACE_END(start, "wrefresh", "flush");
+    METRIC_ADD(curses_calls, 9);
+}
+
+/* Writes a line of the sidebar that changes length, padded to clear the
+ * previous value and cut before the border */
+void draw_stats_line(WINDOW* menuwin, int row, const char* text) {
+    int width = getmaxx(menuwin) - 1 - STATS_COL;
+    mvwprintw(menuwin, row, STATS_COL, "%-*.*s", width, width, text);
 }
 
 /* Create a new window */
@@ -587,12 +2182,14 @@ void draw_menu(WINDOW* menuwin, Menu menu) {
     int spos = (MAXX(menuwin) / 2) - 7;
 
     /* Draw keybindings */
-    int r = MAXY(menuwin) - 4;
+    int r = MAXY(menuwin) - (practice ? 5 : 4);
     int c = 2;
     mvwaddstr(menuwin, r++, c, "Commands:");
     mvwaddstr(menuwin, r++, c, "Move: Arrow keys");
     mvwaddstr(menuwin, r++, c, "Rotate: z/x");
     mvwaddstr(menuwin, r++, c, "Hold: c");
+    if (practice)
+        mvwaddstr(menuwin, r++, c, "Undo: u");
     mvwaddstr(menuwin, r, c, "Quit: q");
 
     /* Draw title of the game */
@@ -645,23 +2242,39 @@ void draw_game_over(Game* game) {
 }
 
 /* Draws the game box based on the block matrix */
-void draw_game_box(Game* game) {
+void draw_game_box(WINDOW* win, const Snapshot* snap) {
+    TRACE_BEGIN(start);
     /* Draw blocks */
-    for (int c = 1; c <= GAME_BLOCK_WIDTH; c++)
-        for (int r = 1; r <= GAME_BLOCK_HEIGHT; r++)
-            for (int i = 0; i <= 1; i++)
-                for (int a = 0; a <= 3; a++)
-                    mvwaddch(game->win, r * 2 - i, c * 4 - a,
-                             BOX_CHAR | COLOR_PAIR(game->blocks[c][r]));
-    wrefresh(game->win);
+    if (compact)
+        for (int c = 1; c <= GAME_BLOCK_WIDTH; c++)
+            for (int r = 1; r <= GAME_BLOCK_HEIGHT; r += 2)
+                draw_half_blocks(win, (r + 1) / 2, c * 2 - 1, snap->blocks[c][r],
+                                 r < GAME_BLOCK_HEIGHT ? snap->blocks[c][r + 1] : COLOR_BLACK, 2);
+    else {
+        for (int c = 1; c <= GAME_BLOCK_WIDTH; c++)
+            for (int r = 1; r <= GAME_BLOCK_HEIGHT; r++)
+                for (int i = 0; i <= 1; i++)
+                    for (int a = 0; a <= 3; a++)
+                        mvwaddch(win, r * 2 - i, c * 4 - a,
+                                 BOX_CHAR | COLOR_PAIR(snap->blocks[c][r]));
+        METRIC_ADD(curses_calls, GAME_BLOCK_WIDTH * GAME_BLOCK_HEIGHT * 2 * 4);
+    }
+    TRACE_END(start, "draw_game_box", "render");
+    unsigned long bytes = written_output();
+    long blocked = atomic_load(&output.blocked);
+    start = trace_path ? now_usec() : 0;
+    wrefresh(win);
+    TRACE_END(start, "wrefresh", "flush");
+    end_frame(written_output() - bytes, atomic_load(&output.blocked) - blocked);
+    METRIC_ADD(curses_calls, 1);
 }
 
 /* Creates the a window for the game */
 WINDOW* create_game_window() {
     WINDOW* my_win;
     int width, height;
-    height = GAME_BLOCK_HEIGHT * 2 + 2;
-    width = GAME_BLOCK_WIDTH * 4 + 2;
+    height = BOX_LINES + 2;
+    width = BOX_COLS + 2;
     my_win = create_newwin(height, width, 0, 1);
     refresh();
     return my_win;
@@ -674,9 +2287,9 @@ WINDOW* create_menu_window() {
     int startx, starty, width, height;
 
     height = LINES;
-    width = (COLS - GAME_BLOCK_WIDTH * 4 - 8);
-    starty = 0;                        /* Calculating for a center placement */
-    startx = GAME_BLOCK_WIDTH * 4 + 6; /* of the window		*/
+    width = (COLS - BOX_COLS - 8);
+    starty = 0;             /* Calculating for a center placement */
+    startx = BOX_COLS + 6; /* of the window		*/
     my_win = create_newwin(height, width, starty, startx);
     refresh();
     return my_win;
@@ -703,8 +2316,11 @@ void create_game(Game* game, WINDOW* gwin) {
         for (int a = 1; a <= GAME_BLOCK_HEIGHT; a++)
             game->blocks[i][a] = COLOR_BLACK;
 
-    tet.inv = rand() % 2;      /* inverted */
-    tet.type = rand() % 5 + 1; /* type */
+    clear_board_stats(&game->board);
+    game->seed = rand() | 1; /* xorshift can't start at 0 */
+    game->rewindpos = 0;
+    game->rewindlen = 0;
+    tet.type = next_random(&game->seed) % rules.npieces + 1;
     tet.color = 1;
     for (int i = 0; i < 4; i++)
         game->selblocks[i].ptr = NULL;
@@ -712,43 +2328,258 @@ void create_game(Game* game, WINDOW* gwin) {
     game->nt = tet;
 }
 
+/* Runs the game until it ends */
 void run_game(Game* game) {
-    int c, d;
-    int nmovemax = 0;
-    game->timer = clock() + GSPEED(game);
-    game->groundtimer = clock();
+    pthread_t sim;
+    int c;
+
     game->isrunning = 1;
     game->isover = 0;
-    if (try_spawn(game, game->nt))
-        show_placed_tetromino(game);
-    game->nt = gentetromino(game->ct);
+    atomic_store(&sim_done, 0);
     clearwin(game->menuwin);
-    draw_game_stats(game);
     refresh();
-    while ((c = wgetch(game->win)) != 'q' && !game->isover && c != KEY_ESCAPE) {
+    if (threaded && !pthread_create(&sim, NULL, simulate, game)) {
+        /* Read the keys and draw the game until the game thread finishes */
+        while (!atomic_load(&sim_done)) {
+            if ((c = wgetch(game->win)) == KEY_RESIZE) {
+                resize_handler();
+            } else if (c != ERR) {
+                unsigned int head = atomic_load(&input_head);
+                if (head - atomic_load(&input_tail) < INPUT_CAP) {
+                    input_buf[head % INPUT_CAP] = c;
+                    atomic_store(&input_head, head + 1);
+                }
+            } else {
+                render_frame(game);
+                idle();
+            }
+        }
+        pthread_join(sim, NULL);
+    } else {
+        threaded = 0;
+        simulate(game);
+    }
+    game->isrunning = 0;
+    /* Finish the game */
+    clearwin(game->win);
+    clearwin(game->menuwin);
+    draw_game_over(game);
+    wrefresh(game->win);
+    refresh();
+}
+
+/* Draws the borders of the arena tiles that fit on the screen and forgets what they show */
+void draw_arena_tiles(int n) {
+    int across = COLS / TILE_COLS;
+    int tiles = across * (LINES / TILE_LINES);
+
+    erase();
+    for (int t = 0; t < n && t < tiles; t++) {
+        int y = t / across * TILE_LINES, x = t % across * TILE_COLS;
+        mvaddch(y, x, ACS_ULCORNER);
+        mvhline(y, x + 1, ACS_HLINE, GAME_BLOCK_WIDTH);
+        mvaddch(y, x + TILE_COLS - 1, ACS_URCORNER);
+        mvvline(y + 1, x, ACS_VLINE, TILE_LINES - 2);
+        mvvline(y + 1, x + TILE_COLS - 1, ACS_VLINE, TILE_LINES - 2);
+        mvaddch(y + TILE_LINES - 1, x, ACS_LLCORNER);
+        mvhline(y + TILE_LINES - 1, x + 1, ACS_HLINE, GAME_BLOCK_WIDTH);
+        mvaddch(y + TILE_LINES - 1, x + TILE_COLS - 1, ACS_LRCORNER);
+    }
+    memset(arena_shown, UNKNOWN_COLOR, (size_t) n * GAME_BLOCK_HEIGHT * GAME_BLOCK_WIDTH);
+    for (int g = 0; g < n; g++)
+        arena_lines[g] = -1;
+    arena_next = 0;
+}
+
+/* Draws the cells of the arena that changed since they were shown, until
+ * the frame runs out of bytes or time. Returns 1 if tiles were left over */
+int draw_arena(Batch* b) {
+    TRACE_BEGIN(start);
+    unsigned long bytes = written_output();
+    long blocked = atomic_load(&output.blocked);
+    long deadline = now_usec() + ARENA_FRAME_TIME;
+    int across = COLS / TILE_COLS;
+    int tiles = across * (LINES / TILE_LINES);
+    int budget = ARENA_FRAME_BYTES, left = 0;
+
+    if (tiles > b->n)
+        tiles = b->n;
+    for (int i = 0; i < tiles; i++) {
+        int g = (arena_next + i) % tiles;
+        int y = g / across * TILE_LINES, x = g % across * TILE_COLS;
+        unsigned char cells[GAME_BLOCK_HEIGHT + 1][GAME_BLOCK_WIDTH];
+        unsigned char* shown = &arena_shown[(size_t) g * GAME_BLOCK_HEIGHT * GAME_BLOCK_WIDTH];
+        const Orientation* o = &kinds[b->kind[g]].rot[b->rot[g]];
+
+        if (budget <= 0 || now_usec() > deadline) {
+            /* Start with this tile next time so every tile gets its turn */
+            arena_next = g;
+            left = 1;
+            break;
+        }
+        /* Placed blocks are white, the falling tetromino has its color */
+        for (int r = 0; r < GAME_BLOCK_HEIGHT; r++)
+            for (int c = 0; c < GAME_BLOCK_WIDTH; c++)
+                cells[r][c] = b->rows[g * GAME_BLOCK_HEIGHT + r] >> c & 1 ? 5 : COLOR_BLACK;
+        memset(cells[GAME_BLOCK_HEIGHT], COLOR_BLACK, GAME_BLOCK_WIDTH);
+        if (!b->done[g])
+            for (int j = 0; j < 4; j++)
+                cells[b->y[g] + o->cells[j][1]][b->x[g] + o->cells[j][0]] = b->color[g];
+        for (int r = 0; r < GAME_BLOCK_HEIGHT; r += 2)
+            for (int c = 0; c < GAME_BLOCK_WIDTH; c++) {
+                unsigned char* top = &shown[r * GAME_BLOCK_WIDTH + c];
+                unsigned char* bottom = top + GAME_BLOCK_WIDTH;
+                if (*top == cells[r][c] && (r + 1 >= GAME_BLOCK_HEIGHT || *bottom == cells[r + 1][c]))
+                    continue;
+                draw_half_blocks(stdscr, y + 1 + r / 2, x + 1 + c, cells[r][c], cells[r + 1][c], 1);
+                *top = cells[r][c];
+                if (r + 1 < GAME_BLOCK_HEIGHT)
+                    *bottom = cells[r + 1][c];
+                budget -= ARENA_CELL_BYTES;
+            }
+        /* Show the lines cleared on the top border */
+        if (arena_lines[g] != b->lines[g]) {
+            arena_lines[g] = b->lines[g];
+            mvhline(y, x + 1, ACS_HLINE, GAME_BLOCK_WIDTH);
+            mvprintw(y, x + 1, "%d", b->lines[g]);
+            budget -= ARENA_CELL_BYTES * 2;
+        }
+    }
+    if (!left)
+        arena_next = 0;
+    TRACE_END(start, "draw_arena", "render");
+    start = trace_path ? now_usec() : 0;
+    /* The whole frame goes out in one write */
+    refresh();
+    TRACE_END(start, "wrefresh", "flush");
+    end_frame(written_output() - bytes, atomic_load(&output.blocked) - blocked);
+    METRIC_ADD(frames, 1);
+    METRIC_ADD(curses_calls, 1);
+    return left;
+}
+
+/* Runs n headless games with random moves and shows them side by side until q is pressed */
+void run_arena(int n) {
+    Batch* b = batch_create(n, time(0) | 1);
+    unsigned char* actions = malloc(n);
+    unsigned int seed = time(0) | 1;
+    long next_step = now_usec();
+    int c, dirty = 1;
+
+    arena_shown = malloc((size_t) n * GAME_BLOCK_HEIGHT * GAME_BLOCK_WIDTH);
+    arena_lines = malloc(n * sizeof(int));
+    if (!b || !actions || !arena_shown || !arena_lines) {
+        endwin();
+        fprintf(stderr, "Not enough memory for %d games\n", n);
+        exit(EXIT_FAILURE);
+    }
+    curs_set(0);
+    nodelay(stdscr, TRUE);
+    draw_arena_tiles(n);
+    while ((c = getch()) != 'q' && c != KEY_ESCAPE) {
+        if (c == KEY_RESIZE) {
+            draw_arena_tiles(n);
+            dirty = 1;
+        } else if (now_usec() > next_step) {
+            for (int g = 0; g < n; g++)
+                actions[g] = next_random(&seed) % ACTIONS;
+            batch_step(b, actions, NULL);
+            next_step += ARENA_TICK;
+            if (next_step < now_usec())
+                next_step = now_usec() + ARENA_TICK;
+            METRIC_ADD(ticks, 1);
+            dirty = 1;
+        } else if (dirty && frame_ready()) {
+            dirty = draw_arena(b);
+        } else {
+            idle();
+        }
+    }
+    free(arena_lines);
+    free(arena_shown);
+    free(actions);
+    batch_free(b);
+}
+
+/* Next key pressed by the player, ERR if there isn't any */
+int next_key(Game* game) {
+    unsigned int tail;
+    int c;
+
+    if (!threaded)
+        return wgetch(game->win);
+    tail = atomic_load(&input_tail);
+    if (tail == atomic_load(&input_head))
+        return ERR;
+    c = input_buf[tail % INPUT_CAP];
+    atomic_store(&input_tail, tail + 1);
+    return c;
+}
+
+/* Sleeps for a moment when there is nothing to do */
+void idle() {
+    struct timespec ts = {0, IDLE_SLEEP};
+    nanosleep(&ts, NULL);
+}
+
+/* Game loop. Only draws through snapshots, so it can run on its own thread */
+void* simulate(void* arg) {
+    Game* game = arg;
+    int c, d;
+    int nmovemax = 0;
+
+    trace_tid = threaded;
+    game->timer = now_usec() + GSPEED(game);
+    game->groundtimer = now_usec();
+    if (try_spawn(game, game->nt))
+        publish_frame(game);
+    game->nt = gentetromino(&game->seed, game->ct);
+    game->stats++;
+    if (practice)
+        save_checkpoint(game);
+    publish_frame(game);
+    METRIC_ADD(started, 1);
+    while ((c = next_key(game)) != 'q' && !game->isover && c != KEY_ESCAPE) {
+        long iter = metrics_path ? now_usec() : 0;
         if (c == ERR) {
+            /* Draw frames that were skipped once the terminal catches up */
+            if (!threaded)
+                render_frame(game);
             /* The user isn't pressing any key */
-            if (clock() > game->timer) {
-                if (check_move(game, 0, 1)) {
-                    move_tetromino(game, 0, 1);
-                    show_placed_tetromino(game);
-                    update_downtime(game);
-                    game->timer = clock() + GSPEED(game);
-                } else if (clock() > game->groundtimer) {
-                    place_tetromino(game);
-                    delete_full_rows(game);
-                    try_spawn(game, game->nt);
-                    game->ct = game->nt;
-                    game->nt = gentetromino(game->ct);
-                    game->canhold = 1;
-                    if (!(game->isover = is_over(game, game->nt)))
-                        show_placed_tetromino(game);
-                    game->timer = clock() + GSPEED(game);
-                    update_downtime(game);
-                    draw_game_stats(game);
-                }
+            if (now_usec() > game->timer && check_move(game, 0, 1)) {
+                TRACE_BEGIN(start);
+                move_tetromino(game, 0, 1);
+                publish_frame(game);
+                update_downtime(game);
+                game->timer = now_usec() + GSPEED(game);
+                METRIC_ADD(ticks, 1);
+                TRACE_END(start, "gravity", "sim");
+            } else if (now_usec() > game->timer && now_usec() > game->groundtimer) {
+                TRACE_BEGIN(start);
+                if (finesse)
+                    score_finesse(game);
+                place_tetromino(game);
+                delete_full_rows(game);
+                try_spawn(game, game->nt);
+                game->ct = game->nt;
+                game->nt = gentetromino(&game->seed, game->ct);
+                game->canhold = 1;
+                if (!(game->isover = is_over(game, game->nt)))
+                    publish_frame(game);
+                game->timer = now_usec() + GSPEED(game);
+                update_downtime(game);
+                game->stats++;
+                if (practice && !game->isover)
+                    save_checkpoint(game);
+                METRIC_ADD(ticks, 1);
+                TRACE_END(start, "lock", "sim");
+            } else {
+                idle();
+                continue;
             }
         } else {
+            TRACE_BEGIN(start);
+            METRIC_ADD(inputs, 1);
             switch (c) {
             case KEY_DOWN:
                 if (check_move(game, 0, 1))
@@ -757,6 +2588,7 @@ void run_game(Game* game) {
             case KEY_LEFT:
             case KEY_RIGHT:
                 d = (c == KEY_LEFT ? -1 : 1);
+                game->presses++;
                 if (!nmovemax) {
                     if (check_move(game, d, 0))
                         move_tetromino(game, d, 0);
@@ -769,52 +2601,70 @@ void run_game(Game* game) {
                 break;
             case '<':
                 nmovemax = 1;
+                game->presses++;
                 break;
             case ' ':
                 /* Move the tetromino down */
                 while (check_move(game, 0, 1))
                     move_tetromino(game, 0, 1);
                 /* Placing a tetromino */
+                if (finesse)
+                    score_finesse(game);
                 place_tetromino(game);
                 delete_full_rows(game);
                 if (!(game->isover = is_over(game, game->nt)))
                     try_spawn(game, game->nt);
                 game->ct = game->nt;
-                game->nt = gentetromino(game->ct);
+                game->nt = gentetromino(&game->seed, game->ct);
                 game->canhold = 1;
-                draw_game_stats(game);
+                game->stats++;
+                if (practice && !game->isover)
+                    save_checkpoint(game);
+                break;
+            case 'u':
+                /* Undo the last placement */
+                if (practice && rewind_game(game)) {
+                    if (finesse)
+                        plan_finesse(game);
+                    game->timer = now_usec() + GSPEED(game);
+                    game->stats++;
+                }
                 break;
             case 'c':
                 if (!is_over(game, game->oh))
                     put_on_hold(game);
-                draw_game_stats(game);
+                game->stats++;
                 break;
             case 'z':
             case 'x':
                 d = (c == 'z' ? -1 : 1);
                 try_rotate(game, d);
+                game->presses++;
                 break;
             case KEY_RESIZE:
+                /* Only received when the game runs on the main thread */
                 resize_handler();
                 break;
             }
-            update_downtime(game);
-            show_placed_tetromino(game);
+            /* There's no tetromino to move after a hard drop ends the game */
+            if (!game->isover)
+                update_downtime(game);
+            TRACE_END(start, "handle_input", "input");
+            publish_frame(game);
         }
+        if (metrics_path)
+            observe_latency(now_usec() - iter);
     }
     game->isover = 1;
-    game->isrunning = 0;
-    /* Finish the game */
-    clearwin(game->win);
-    clearwin(game->menuwin);
-    draw_game_over(game);
-    wrefresh(game->win);
-    refresh();
+    publish_frame(game);
+    METRIC_ADD(ended, 1);
+    atomic_store(&sim_done, 1);
+    return NULL;
 }
 
 void resize_handler() {
     refresh();
-    if (LINES < MINLINES || COLS < MINCOLS) {
+    if (LINES < MIN_LINES || COLS < MIN_COLS) {
         endwin();
         exit(EXIT_FAILURE);
     }
@@ -828,25 +2678,107 @@ void resize_handler() {
     if (!game.isrunning)
         draw_menu(menu_window, menu);
     else
-        draw_game_stats(&game);
+        draw_game_stats(menu_window, &snaps[snap_front]);
     box(game.win, 0, 0);
-    if (game.isover)
+    if (!game.isrunning && game.isover)
         draw_game_over(&game);
     else
-        draw_game_box(&game);
+        draw_game_box(game.win, &snaps[snap_front]);
     refresh();
 }
 
 int main(int argc, char* argv[]) {
 
+    const char *rules_path = NULL, *perft_seq = NULL, *board_path = NULL;
+    uint16_t board[GAME_BLOCK_HEIGHT] = {0};
+    int bench = 0;
+
     /* Read arguments */
     for (int i = 1; i < argc; i++) {
         if (!strcmp(argv[i], "-v") || !strcmp(argv[i], "--version")) {
             printf("termetris-%s\n", VERSION);
             exit(EXIT_SUCCESS);
+        } else if (!strcmp(argv[i], "-t") || !strcmp(argv[i], "--trace")) {
+            if (i + 1 >= argc) {
+                fprintf(stderr, "%s: missing file name\n", argv[i]);
+                exit(EXIT_FAILURE);
+            }
+            trace_path = argv[++i];
+        } else if (!strcmp(argv[i], "-c") || !strcmp(argv[i], "--compact")) {
+            compact = 1;
+        } else if (!strcmp(argv[i], "-s") || !strcmp(argv[i], "--single-thread")) {
+            threaded = 0;
+        } else if (!strcmp(argv[i], "-p") || !strcmp(argv[i], "--practice")) {
+            practice = 1;
+        } else if (!strcmp(argv[i], "-a") || !strcmp(argv[i], "--arena")) {
+            if (i + 1 >= argc || atoi(argv[i + 1]) <= 0) {
+                fprintf(stderr, "%s: missing number of games\n", argv[i]);
+                exit(EXIT_FAILURE);
+            }
+            arena = atoi(argv[++i]);
+            compact = 1; /* The tiles are drawn with half blocks */
+        } else if (!strcmp(argv[i], "-P") || !strcmp(argv[i], "--perft")) {
+            if (i + 1 >= argc) {
+                fprintf(stderr, "%s: missing tetrominos\n", argv[i]);
+                exit(EXIT_FAILURE);
+            }
+            perft_seq = argv[++i];
+        } else if (!strcmp(argv[i], "-B") || !strcmp(argv[i], "--board")) {
+            if (i + 1 >= argc) {
+                fprintf(stderr, "%s: missing file name\n", argv[i]);
+                exit(EXIT_FAILURE);
+            }
+            board_path = argv[++i];
+        } else if (!strcmp(argv[i], "-r") || !strcmp(argv[i], "--rules")) {
+            if (i + 1 >= argc) {
+                fprintf(stderr, "%s: missing file name\n", argv[i]);
+                exit(EXIT_FAILURE);
+            }
+            rules_path = argv[++i];
+        } else if (!strcmp(argv[i], "-f") || !strcmp(argv[i], "--finesse")) {
+            finesse = 1;
+        } else if (!strcmp(argv[i], "-m") || !strcmp(argv[i], "--metrics")) {
+            if (i + 1 >= argc) {
+                fprintf(stderr, "%s: missing socket path\n", argv[i]);
+                exit(EXIT_FAILURE);
+            }
+            metrics_path = argv[++i];
+        } else if (!strcmp(argv[i], "-b") || !strcmp(argv[i], "--bench")) {
+            if (i + 1 >= argc || atoi(argv[i + 1]) <= 0) {
+                fprintf(stderr, "%s: missing number of games\n", argv[i]);
+                exit(EXIT_FAILURE);
+            }
+            bench = atoi(argv[++i]);
+        }
+    }
+
+    if (rules_path)
+        load_rules(rules_path);
+    init_kinds();
+    if (bench) {
+        bench_batch(bench);
+        exit(EXIT_SUCCESS);
+    }
+    if (perft_seq) {
+        if (!*perft_seq || strspn(perft_seq, rules.names) != strlen(perft_seq) ||
+            strlen(perft_seq) > PERFT_MAX_DEPTH) {
+            fprintf(stderr, "--perft: expected up to %d tetrominos out of %s\n", PERFT_MAX_DEPTH, rules.names);
+            exit(EXIT_FAILURE);
         }
+        if (board_path)
+            load_board(board_path, board);
+        run_perft(perft_seq, board);
+        exit(EXIT_SUCCESS);
     }
 
+    /* Dump the trace at exit, including when the terminal gets too small */
+    if (trace_path)
+        atexit(trace_dump);
+    if (metrics_path)
+        open_metrics();
+
+    setlocale(LC_ALL, ""); /* Needed to draw the half blocks */
+    open_output();
     initscr(); /* Initialize curse's main source */
 
     if (!has_colors()) {
@@ -855,7 +2787,7 @@ int main(int argc, char* argv[]) {
         return EXIT_FAILURE;
     }
 
-    if (LINES < MINLINES || COLS < MINCOLS) {
+    if (LINES < MIN_LINES || COLS < MIN_COLS) {
         endwin();
         printf("Not enough space to play the game, try resizing the terminal window or decrease the font size.\n");
         return EXIT_FAILURE;
@@ -873,6 +2805,12 @@ int main(int argc, char* argv[]) {
     init_color_pairs();
     refresh();
 
+    if (arena) {
+        run_arena(arena);
+        endwin();
+        return EXIT_SUCCESS;
+    }
+
     /* Initialize the menu */
     menu_window = create_menu_window();
     menu = start_menu(menu_window);